@@ -1,8 +1,42 @@
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <tgmath.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "raycast.h"
+
+// The numeric type of scene data and ray math. Building with
+// -DRAYCAST_FLOAT selects single precision, which halves the size of the
+// scene and doubles the number of objects per intersection vector.
+#ifdef RAYCAST_FLOAT
+typedef float real;
+#define REAL_NAME "float"
+#else
+typedef double real;
+#define REAL_NAME "double"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYCAST_X86
+#include <immintrin.h>
+#endif
 
 #define PLANE 0
 #define SPHERE 1
@@ -11,91 +45,245 @@
 
 #define MAX_COLOR_VALUE 255
 
-int line = 1;
+#define MAX_STRING_LENGTH 128
+
+#define SPECULAR_EXPONENT 20
+
+// Width and height, in pixels, of the blocks handed to render threads.
+#define TILE_SIZE 32
+
+// Bounding volume hierarchy build parameters.
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 16
+#define BVH_MAX_DEPTH 64
+
+// Widest vector, in reals, of any intersection kernel.
+#define KERNEL_WIDTH (32 / (int)sizeof(real))
 
 typedef struct {
   unsigned char r, g, b;
 } Pixel;
 
 typedef struct {
-  double width;
-  double height;
+  real width;
+  real height;
 } Camera;
 
+// Materials are stored once per scene and shared by every object that
+// uses the same colors.
+typedef struct {
+  real diffuseColor[3];
+  real specularColor[3];
+} Material;
+
 typedef struct {
   int kind; // 0 = Plane, 1 = Sphere, 2 = Camera, 3 = Light
-  double diffuseColor[3];
-  double specularColor[3];
-  double position[3];
+  int material; // index into Scene.materials
+  real position[3];
   union {
     struct {
-      double normal[3];
+      real normal[3];
     } plane;
     struct {
-      double radius;
+      real radius;
     } sphere;
   };
 } Object;
 
 typedef struct {
-  double color[3];
-  double position[3];
-  double direction[3];
-  double radialAtten[3];
-  double angularAtten;
-  double theta;
+  real color[3];
+  real position[3];
+  real direction[3];
+  real radialAtten[3];
+  real angularAtten;
+  real theta;
 } Light;
 
-Pixel* pixmap;
-Camera** camera;
-Object** objects;
-Light** lights;
+// PreparedLight is a Light reduced to what the shader needs, built by
+// prepareLights() once the scene is parsed.
+typedef struct {
+  real color[3];
+  real position[3];
+  real direction[3];
+  real radialAtten[3];
+  real angularAtten;
+  real cosHalfTheta; // spot lights only
+  int radial;          // whether radial attenuation applies
+  real reach;          // distance beyond which the light is culled, or INFINITY
+} PreparedLight;
+
+typedef struct {
+  real min[3];
+  real max[3];
+} AABB;
+
+// LightGrid finds the lights that can reach a point. A light with a
+// finite reach is listed in every cell its sphere of influence overlaps.
+// The rest, or every light when too few have a finite reach, are in the
+// global list. All lists are in increasing light order.
+typedef struct {
+  AABB bounds;
+  int dims[3];
+  real inverseCell; // cells per unit length
+  int* cellFirst;   // per cell, its first entry in cellLights; NULL if no grid
+  int* cellLights;
+  int* global;
+  int globalCount;
+} LightGrid;
+
+// Interior nodes keep their left child directly after them in the node
+// array and the right child at offset. Leaves cover count spheres
+// starting at offset in Scene.spheres.
+typedef struct {
+  AABB box;
+  int offset;
+  int count;
+  int axis;
+} BVHNode;
+
+// Sphere and plane geometry stored one array per component, so the
+// intersection kernels can load several objects with one instruction.
+typedef struct {
+  real* x;
+  real* y;
+  real* z;
+  real* r2;
+} SphereSoA;
+
+typedef struct {
+  real* px;
+  real* py;
+  real* pz;
+  real* nx;
+  real* ny;
+  real* nz;
+} PlaneSoA;
+
+typedef struct {
+  const char* name;
+  int (*supported)();
+  void (*spheres)(const SphereSoA* s, int first, int count, const real* Ro, const real* Rd, real* t);
+  void (*planes)(const PlaneSoA* p, int first, int count, const real* Ro, const real* Rd, real* t);
+} IntersectKernel;
+
+// An Arena hands out memory from large blocks and releases all of it at
+// once. Everything a scene owns is allocated from the scene's arena.
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock* head;
+  void* last;       // most recent allocation, which can grow in place
+  size_t lastSize;
+  jmp_buf* failure; // jumped to with RAYCAST_ERROR_MEMORY if set, else running out exits
+} Arena;
+
+// MappedFile is a private, copy-on-write view of a whole file, memory mapped when
+// possible and read into a heap buffer otherwise.
+typedef struct {
+  char* data;
+  size_t size;
+  int mapped;
+} MappedFile;
+
+typedef struct RaycastScene {
+  Arena arena;
+  Arena accelArena; // acceleration data, rebuilt when geometry changes
+  Camera* camera;
+  Object* objects;
+  int objectCount;
+  int objectCapacity;
+  Material* materials;
+  int materialCount;
+  int materialCapacity;
+  Light* lights;
+  int lightCount;
+  int lightCapacity;
+
+  // Acceleration data built by buildBVH() once parsing is done.
+  int* planes;
+  int planeCount;
+  int* spheres;
+  int sphereCount;
+  BVHNode* nodes;
+  int nodeCount;
+  SphereSoA sphereSoA; // in the same order as spheres
+  PlaneSoA planeSoA;   // in the same order as planes
+  const IntersectKernel* kernel;
+
+  // Samples per pixel along each axis at edges found by createScene(),
+  // a power of two. 1 disables antialiasing.
+  int maxSamples;
 
-static inline double degreesToRads(double d) {
+  // 0 traces every ray on its own instead of in packets.
+  int packets;
+
+  // Threads that parsing a large JSON file may be split between.
+  int parseThreads;
+
+  // Lights built by prepareLights(), point lights first.
+  PreparedLight* preparedLights;
+  int pointLightCount;
+  int spotLightCount;
+  LightGrid lightGrid;
+
+  // A light is skipped where it cannot add this much to any channel of
+  // the surface it would shade. 0 keeps every light.
+  real lightCutoff;
+
+  // A compiled scene cache that objects, lights and acceleration data
+  // point into, if the scene was loaded from one.
+  MappedFile cache;
+} Scene;
+
+static inline real degreesToRads(real d) {
   return d * 0.0174533;
 }
 
-static inline double sqr(double v) {
+static inline real sqr(real v) {
   return v*v;
 }
 
-static inline void normalize(double* v) {
-  double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+static inline void normalize(real* v) {
+  real len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
   v[0] /= len;
   v[1] /= len;
   v[2] /= len;
 }
 
-static inline double dot(const double* a, const double* b) {
+static inline real dot(const real* a, const real* b) {
   return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
 }
 
-static inline double magnitude(const double* v) {
+static inline real magnitude(const real* v) {
   return sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
 }
 
-static inline void subtract(double* v1, const double* v2) {
+static inline void subtract(real* v1, const real* v2) {
   v1[0] -= v2[0];
   v1[1] -= v2[1];
   v1[2] -= v2[2];
 }
 
-double clamp(double value, double min, double max) {
+real clamp(real value, real min, real max) {
   if (value < min) return min;
   if (value > max) return max;
   return value;
 }
 
-void scale(double*v, double s) {
+void scale(real*v, real s) {
   v[0] *= s;
   v[1] *= s;
   v[2] *= s;
 }
 
-void reflect(const double* v, const double* n, double* r) {
-  double dotResult = dot(v, n);
+void reflect(const real* v, const real* n, real* r) {
+  real dotResult = dot(v, n);
   dotResult *= 2;
-  double nNew[3] = {
+  real nNew[3] = {
     n[0],
     n[1],
     n[2]
@@ -107,694 +295,5837 @@ void reflect(const double* v, const double* n, double* r) {
   subtract(r, nNew);
 }
 
-void negate(double* v) {
+void negate(real* v) {
   v[0] = -v[0];
   v[1] = -v[1];
   v[2] = -v[2];
 }
 
 
-// Wraps the getc() function and provides error checking and
-// number maintenance
-int fnextc(FILE* json) {
-  int c = fgetc(json);
+// Blocks start at 1 MB and double from there, so a scene with millions
+// of primitives only needs a handful of them.
+#define ARENA_MIN_BLOCK (1 << 20)
+#define ARENA_ALIGN 32
+
+void arenaInit(Arena* arena) {
+  arena->head = NULL;
+  arena->last = NULL;
+  arena->failure = NULL;
+  arena->lastSize = 0;
+}
+
+// outOfMemory handles an allocation that failed. It jumps to failure
+// with RAYCAST_ERROR_MEMORY if that is set and otherwise exits.
+static void outOfMemory(jmp_buf* failure) __attribute__((noreturn));
+static void outOfMemory(jmp_buf* failure) {
+  if (failure != NULL) {
+    longjmp(*failure, RAYCAST_ERROR_MEMORY);
+  }
+  fprintf(stderr, "Error: Out of memory.\n");
+  exit(1);
+}
+
+void* arenaAlloc(Arena* arena, size_t size) {
+  size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  ArenaBlock* block = arena->head;
+  if (block == NULL || block->size - block->used < size) {
+    size_t blockSize = block == NULL ? ARENA_MIN_BLOCK : block->size * 2;
+    while (blockSize < size) {
+      blockSize *= 2;
+    }
+    block = aligned_alloc(ARENA_ALIGN, header + blockSize);
+    if (block == NULL) {
+      outOfMemory(arena->failure);
+    }
+    block->next = arena->head;
+    block->size = blockSize;
+    block->used = 0;
+    arena->head = block;
+  }
+  void* p = (char*)block + header + block->used;
+  block->used += size;
+  arena->last = p;
+  arena->lastSize = size;
+  return p;
+}
+
+// arenaGrow resizes an allocation. The most recent allocation grows in
+// place when its block has room; anything else is copied to new space.
+void* arenaGrow(Arena* arena, void* p, size_t oldSize, size_t newSize) {
+  size_t rounded = (newSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  ArenaBlock* block = arena->head;
+  if (p != NULL && p == arena->last && block->size - block->used >= rounded - arena->lastSize) {
+    block->used += rounded - arena->lastSize;
+    arena->lastSize = rounded;
+    return p;
+  }
+  void* grown = arenaAlloc(arena, newSize);
+  if (p != NULL) {
+    memcpy(grown, p, oldSize);
+  }
+  return grown;
+}
+
+// arenaReset releases everything allocated from the arena but keeps its
+// largest block for reuse.
+void arenaReset(Arena* arena) {
+  ArenaBlock* block = arena->head;
+  if (block == NULL) return;
+  ArenaBlock* next = block->next;
+  while (next != NULL) {
+    ArenaBlock* after = next->next;
+    free(next);
+    next = after;
+  }
+  block->next = NULL;
+  block->used = 0;
+  arena->last = NULL;
+  arena->lastSize = 0;
+}
+
+void arenaFree(Arena* arena) {
+  ArenaBlock* block = arena->head;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  arenaInit(arena);
+}
+
+void freeLightGrid(LightGrid* grid) {
+  free(grid->cellFirst);
+  free(grid->cellLights);
+  free(grid->global);
+  memset(grid, 0, sizeof(LightGrid));
+}
+
+void initScene(Scene* scene) {
+  memset(scene, 0, sizeof(Scene));
+  scene->maxSamples = 1;
+  scene->packets = 1;
+  scene->parseThreads = 1;
+  arenaInit(&scene->arena);
+  arenaInit(&scene->accelArena);
+}
+
+// addObject returns a new slot at the end of the scene's object array,
+// growing the array when it is full.
+Object* addObject(Scene* scene) {
+  if (scene->objectCount == scene->objectCapacity) {
+    int capacity = scene->objectCapacity == 0 ? 64 : scene->objectCapacity * 2;
+    scene->objects = arenaGrow(&scene->arena, scene->objects,
+      sizeof(Object) * scene->objectCapacity, sizeof(Object) * capacity);
+    scene->objectCapacity = capacity;
+  }
+  return &scene->objects[scene->objectCount++];
+}
+
+Material* addMaterial(Scene* scene) {
+  if (scene->materialCount == scene->materialCapacity) {
+    int capacity = scene->materialCapacity == 0 ? 16 : scene->materialCapacity * 2;
+    scene->materials = arenaGrow(&scene->arena, scene->materials,
+      sizeof(Material) * scene->materialCapacity, sizeof(Material) * capacity);
+    scene->materialCapacity = capacity;
+  }
+  return &scene->materials[scene->materialCount++];
+}
+
+// Number of objects the material table looks up before deciding whether
+// the scene shares materials enough to keep deduplicating.
+#define MATERIAL_SAMPLE 16384
+
+typedef struct {
+  uint32_t hash;
+  int index;
+} MaterialSlot;
+
+// MaterialTable collects the distinct materials of a scene while it is
+// parsed. They are kept outside the scene arena until the parse ends so
+// that the object array stays the arena's last allocation and can grow
+// in place.
+typedef struct {
+  Material* materials;
+  int count;
+  int capacity;
+  MaterialSlot* slots; // open addressing, index -1 when empty
+  int slotCapacity; // a power of two
+  int lookups;
+  int hits;
+  int appendOnly;
+} MaterialTable;
+
+static inline uint32_t materialHash(const Material* material) {
+  uint64_t hash = 0;
+  for (size_t i = 0; i < sizeof(Material); i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, (const char*)material + i, sizeof(word));
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+  }
+  return (uint32_t)hash;
+}
+
+// internMaterial returns the index of the table's material equal to
+// material, adding it if there is none. Returns -1, leaving the table
+// as it was, if there is not enough memory.
+int internMaterial(MaterialTable* table, const Material* material) {
+  if (table->count == table->capacity) {
+    int capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+    Material* materials = realloc(table->materials, sizeof(Material) * capacity);
+    if (materials == NULL) return -1;
+    table->materials = materials;
+    table->capacity = capacity;
+  }
+
+  // When almost every object has its own colors the lookups cost far
+  // more than they save, so after a sample like that the table only
+  // appends.
+  if (table->lookups == MATERIAL_SAMPLE && table->hits * 16 < table->lookups) {
+    table->appendOnly = 1;
+  }
+  if (table->appendOnly) {
+    table->materials[table->count] = *material;
+    return table->count++;
+  }
+  table->lookups++;
+
+  if (2 * (table->count + 1) > table->slotCapacity) {
+    int capacity = table->slotCapacity == 0 ? 64 : table->slotCapacity * 2;
+    MaterialSlot* slots = malloc(sizeof(MaterialSlot) * capacity);
+    if (slots == NULL) return -1;
+    for (int i = 0; i < capacity; i++) slots[i].index = -1;
+    for (int i = 0; i < table->slotCapacity; i++) {
+      if (table->slots[i].index < 0) continue;
+      size_t slot = table->slots[i].hash & (capacity - 1);
+      while (slots[slot].index >= 0) slot = (slot + 1) & (capacity - 1);
+      slots[slot] = table->slots[i];
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slotCapacity = capacity;
+  }
+
+  uint32_t hash = materialHash(material);
+  size_t slot = hash & (table->slotCapacity - 1);
+  while (table->slots[slot].index >= 0) {
+    int index = table->slots[slot].index;
+    if (table->slots[slot].hash == hash && memcmp(&table->materials[index], material, sizeof(Material)) == 0) {
+      table->hits++;
+      return index;
+    }
+    slot = (slot + 1) & (table->slotCapacity - 1);
+  }
+
+  table->materials[table->count] = *material;
+  table->slots[slot].hash = hash;
+  table->slots[slot].index = table->count;
+  return table->count++;
+}
+
+// finishMaterials moves the table's materials into the scene and frees
+// the table.
+void finishMaterials(Scene* scene, MaterialTable* table) {
+  scene->materials = arenaAlloc(&scene->arena, sizeof(Material) * table->count);
+  memcpy(scene->materials, table->materials, sizeof(Material) * table->count);
+  scene->materialCount = table->count;
+  scene->materialCapacity = table->count;
+  free(table->materials);
+  free(table->slots);
+}
+
+Light* addLight(Scene* scene) {
+  if (scene->lightCount == scene->lightCapacity) {
+    int capacity = scene->lightCapacity == 0 ? 16 : scene->lightCapacity * 2;
+    scene->lights = arenaGrow(&scene->arena, scene->lights,
+      sizeof(Light) * scene->lightCapacity, sizeof(Light) * capacity);
+    scene->lightCapacity = capacity;
+  }
+  return &scene->lights[scene->lightCount++];
+}
+
+
+// Parser reads a scene from a buffer holding the whole JSON file.
+typedef struct {
+  const char* p;   // next character to read
+  const char* end;
+  int line;
+  MaterialTable materials;
+  RaycastError* error;
+  jmp_buf* failure;
+} Parser;
+
+// parseError stops the parse, which then returns the formatted message
+// as its error. The command line prints it after "Error: ".
+static void parseError(Parser* json, const char* format, ...) __attribute__((noreturn, format(printf, 2, 3)));
+static void parseError(Parser* json, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(json->error->message, sizeof(json->error->message), format, args);
+  va_end(args);
+  json->error->line = json->line;
+  longjmp(*json->failure, RAYCAST_ERROR_PARSE);
+}
+
+// mapFile opens and maps the file at path. Returns 0 if the file could
+// not be opened or read.
+int mapFile(const char* path, MappedFile* file) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  file->data = NULL;
+  file->size = 0;
+  file->mapped = 0;
+  if (S_ISREG(st.st_mode)) {
+    file->size = st.st_size;
+    if (file->size == 0) {
+      close(fd);
+      return 1;
+    }
+    void* data = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, file->size, MADV_SEQUENTIAL);
+      file->data = data;
+      file->mapped = 1;
+      close(fd);
+      return 1;
+    }
+  }
+
+  // Pipes and other files that can't be mapped are read in full.
+  size_t capacity = 1 << 16;
+  file->data = malloc(capacity);
+  file->size = 0;
+  while (file->data != NULL) {
+    if (file->size == capacity) {
+      char* grown = realloc(file->data, capacity * 2);
+      if (grown == NULL) break;
+      file->data = grown;
+      capacity *= 2;
+    }
+    ssize_t n = read(fd, file->data + file->size, capacity - file->size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+    if (n == 0) {
+      close(fd);
+      return 1;
+    }
+    file->size += n;
+  }
+  free(file->data);
+  close(fd);
+  return 0;
+}
+
+void unmapFile(MappedFile* file) {
+  if (file->mapped) {
+    munmap(file->data, file->size);
+  } else {
+    free(file->data);
+  }
+}
+
+// freeScene releases the scene and everything built from it.
+void freeScene(Scene* scene) {
+  freeLightGrid(&scene->lightGrid);
+  arenaFree(&scene->arena);
+  arenaFree(&scene->accelArena);
+  if (scene->cache.data != NULL) {
+    unmapFile(&scene->cache);
+  }
+}
+
+// nextc returns the next character and provides error checking and
+// line number maintenance.
+static inline int nextc(Parser* json) {
+  if (json->p == json->end) {
+    parseError(json, "Unexpected end of file on line number %d.", json->line);
+  }
+  int c = (unsigned char)*json->p++;
 #ifdef DEBUG
-  printf("fnextc: '%c'\n", c);
+  printf("nextc: '%c'\n", c);
 #endif
   if (c == '\n') {
-    line++;
-  }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
+    json->line++;
   }
   return c;
 }
 
-// fexpectc() checks that the next character in d. If it is not it
+// expectc() checks that the next character in d. If it is not it
 // emits and error.
-void fexpectc(FILE* json, int d) {
-  int c = fnextc(json);
+void expectc(Parser* json, int d) {
+  int c = nextc(json);
   if (c == d) return;
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-  exit(1);
+  parseError(json, "Expected '%c' on line %d.", d, json->line);
 }
 
-// skipWhitespace skips white space in the file.
-void skipWhitespace(FILE* json) {
-  int c = fnextc(json);
-  while (isspace(c)) {
-    c = fnextc(json);
+// skipWhitespace skips white space in the buffer. Running out of input
+// is an error, since every caller expects something to follow.
+static inline void skipWhitespace(Parser* json) {
+  const char* p = json->p;
+  const char* end = json->end;
+  while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) {
+    if (*p == '\n') {
+      json->line++;
+    }
+    p++;
+  }
+  json->p = p;
+  if (p == end) {
+    nextc(json);
   }
-  ungetc(c, json);
 }
 
-// parseString gets the next string from the file handle and emits
-// an error if a string can not be obtained.
-char* nextString(FILE* json) {
-  char buffer[129];
-  int c = fnextc(json);
+// nextString points *s at the next string in the buffer and returns its
+// length. It emits an error if a string can not be obtained.
+int nextString(Parser* json, const char** s) {
+  int c = nextc(json);
   if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
-    exit(1);
+    parseError(json, "Expected string on line %d.", json->line);
   }
-  c = fnextc(json);
-  int i = 0;
-  while (c != '"') {
-    if (i >= 128) {
-      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported. See line %d.\n", line);
-      exit(1);
-    } else if (c == '\\') {
-      fprintf(stderr, "Error: Strings with escape codes are not supperted. See line %d.\n", line);
-      exit(1);
-    } else if (c < 32 || c > 126) {
-      fprintf(stderr, "Error: Strings may contain only ascii characters. See line %d.\n", line);
-      exit(1);
-    }
-    buffer[i] = c;
-    i++;
-    c = fnextc(json);
+  *s = json->p;
+
+  // Strings can't contain newlines, so the scan needs no line counting.
+  const char* p = json->p;
+  const char* limit = json->end - p > MAX_STRING_LENGTH ? p + MAX_STRING_LENGTH : json->end;
+  while (p < limit && *p != '"' && *p != '\\' && *p >= 32 && *p <= 126) {
+    p++;
+  }
+  int i = p - json->p;
+  json->p = p;
+  c = nextc(json);
+  if (c == '"') return i;
+
+  if (i >= MAX_STRING_LENGTH) {
+    parseError(json, "Strings longer than 128 characters in length are not supported. See line %d.", json->line);
+  } else if (c == '\\') {
+    parseError(json, "Strings with escape codes are not supperted. See line %d.", json->line);
   }
-  buffer[i] = '\0';
-  return strdup(buffer);
+  parseError(json, "Strings may contain only ascii characters. See line %d.", json->line);
 }
 
-double nextNumber(FILE* json) {
-  double value;
-  fscanf(json, "%lf", &value);
-  // Error check this...
+static const double powersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// slowNumber hands the number at the read position to strtod(), which
+// handles every form fscanf("%lf") accepts.
+double slowNumber(Parser* json) {
+  char buffer[64];
+  int n = 0;
+  const char* p = json->p;
+  while (p < json->end && n < (int)sizeof(buffer) - 1 && strchr("+-.0123456789eExXpPaAbBcCdDfFiInNtTyY", *p) != NULL && *p != '\0') {
+    buffer[n++] = *p++;
+  }
+  buffer[n] = '\0';
+
+  char* numberEnd;
+  double value = strtod(buffer, &numberEnd);
+  if (numberEnd == buffer) {
+    parseError(json, "Expected number on line %d.", json->line);
+  }
+  json->p += numberEnd - buffer;
   return value;
 }
 
-double* nextVector(FILE* json) {
-  double* v = malloc(3 * sizeof(double));
-  fexpectc(json, '[');
+// nextNumber reads a number. Numbers with at most 19 significant digits
+// and a power of ten within +-22 convert exactly with one multiply or
+// divide, which rounds the same way strtod() does. Everything else goes
+// through slowNumber().
+double nextNumber(Parser* json) {
+  skipWhitespace(json);
+  const char* p = json->p;
+  const char* end = json->end;
+
+  int negative = 0;
+  if (*p == '-' || *p == '+') {
+    negative = *p == '-';
+    p++;
+  }
+
+  unsigned long long mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  int sawDigit = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    mantissa = mantissa * 10 + (*p - '0');
+    if (mantissa != 0) digits++;
+    sawDigit = 1;
+    p++;
+    if (digits > 19) return slowNumber(json);
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa != 0) digits++;
+      exponent--;
+      sawDigit = 1;
+      p++;
+      if (digits > 19) return slowNumber(json);
+    }
+  }
+  if (!sawDigit) return slowNumber(json);
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    int negativeExponent = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+      negativeExponent = *p == '-';
+      p++;
+    }
+    if (p == end || *p < '0' || *p > '9') return slowNumber(json);
+    int e = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (e < 10000) e = e * 10 + (*p - '0');
+      p++;
+    }
+    exponent += negativeExponent ? -e : e;
+  }
+
+  if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22) {
+    return slowNumber(json);
+  }
+
+  double value = (double)mantissa;
+  if (exponent < 0) {
+    value /= powersOfTen[-exponent];
+  } else {
+    value *= powersOfTen[exponent];
+  }
+  json->p = p;
+  return negative ? -value : value;
+}
+
+void nextVector(Parser* json, real* v) {
+  expectc(json, '[');
   skipWhitespace(json);
   v[0] = nextNumber(json);
   skipWhitespace(json);
-  fexpectc(json, ',');
+  expectc(json, ',');
   skipWhitespace(json);
   v[1] = nextNumber(json);
   skipWhitespace(json);
-  fexpectc(json, ',');
+  expectc(json, ',');
   skipWhitespace(json);
   v[2] = nextNumber(json);
   skipWhitespace(json);
-  fexpectc(json, ']');
-  return v;
+  expectc(json, ']');
+}
+
+enum {
+  KEY_UNKNOWN,
+  KEY_WIDTH,
+  KEY_HEIGHT,
+  KEY_RADIUS,
+  KEY_COLOR,
+  KEY_DIFFUSE_COLOR,
+  KEY_SPECULAR_COLOR,
+  KEY_POSITION,
+  KEY_NORMAL,
+  KEY_DIRECTION,
+  KEY_RADIAL_A2,
+  KEY_RADIAL_A1,
+  KEY_RADIAL_A0,
+  KEY_ANGULAR_A0,
+  KEY_THETA
+};
+
+static inline int keyIs(const char* key, int length, const char* name, int id) {
+  return memcmp(key, name, length) == 0 ? id : KEY_UNKNOWN;
+}
+
+// lookupKey maps a property name to its KEY_ constant. The length and
+// one distinguishing character narrow it to a single candidate, which
+// is then confirmed with one memcmp().
+int lookupKey(const char* key, int length) {
+  switch (length) {
+    case 5:
+      switch (key[0]) {
+        case 'w': return keyIs(key, length, "width", KEY_WIDTH);
+        case 'c': return keyIs(key, length, "color", KEY_COLOR);
+        case 't': return keyIs(key, length, "theta", KEY_THETA);
+      }
+      break;
+    case 6:
+      switch (key[0]) {
+        case 'h': return keyIs(key, length, "height", KEY_HEIGHT);
+        case 'r': return keyIs(key, length, "radius", KEY_RADIUS);
+        case 'n': return keyIs(key, length, "normal", KEY_NORMAL);
+      }
+      break;
+    case 8:
+      return keyIs(key, length, "position", KEY_POSITION);
+    case 9:
+      switch (key[8]) {
+        case 'n': return keyIs(key, length, "direction", KEY_DIRECTION);
+        case '2': return keyIs(key, length, "radial-a2", KEY_RADIAL_A2);
+        case '1': return keyIs(key, length, "radial-a1", KEY_RADIAL_A1);
+        case '0': return keyIs(key, length, "radial-a0", KEY_RADIAL_A0);
+      }
+      break;
+    case 10:
+      return keyIs(key, length, "angular-a0", KEY_ANGULAR_A0);
+    case 13:
+      return keyIs(key, length, "diffuse_color", KEY_DIFFUSE_COLOR);
+    case 14:
+      return keyIs(key, length, "specular_color", KEY_SPECULAR_COLOR);
+  }
+  return KEY_UNKNOWN;
+}
+
+// lookupType maps an object type name to its kind, or -1 if unknown.
+int lookupType(const char* value, int length) {
+  switch (length) {
+    case 5:
+      if (memcmp(value, "plane", 5) == 0) return PLANE;
+      if (memcmp(value, "light", 5) == 0) return LIGHT;
+      break;
+    case 6:
+      if (memcmp(value, "sphere", 6) == 0) return SPHERE;
+      if (memcmp(value, "camera", 6) == 0) return CAMERA;
+      break;
+  }
+  return -1;
 }
 
-void parseObject(FILE* json, int currentObject, int objectType) {
+// fillRadialDefaults gives a light that sets any radial attenuation
+// coefficient defaults for the others.
+void fillRadialDefaults(Light* light) {
+  if (light->radialAtten[0] != INFINITY || light->radialAtten[1] != INFINITY || light->radialAtten[2] != INFINITY) {
+    if (light->radialAtten[0] == INFINITY) {
+      light->radialAtten[0] = 0;
+    }
+    if (light->radialAtten[1] == INFINITY) {
+      light->radialAtten[1] = 0;
+    }
+    if (light->radialAtten[2] == INFINITY) {
+      light->radialAtten[2] = 1;
+    }
+  }
+}
+
+void improperField(Parser* json) {
+  parseError(json, "Improper object field on line %d.", json->line);
+}
+
+// parseObject reads the fields of one object into camera, object or
+// light, whichever matches objectType. An object's colors go to material.
+void parseObject(Parser* json, Camera* camera, Object* object, Material* material, Light* light, int objectType) {
   int c;
+  const char* key;
 
   if (objectType == SPHERE || objectType == PLANE) {
-    objects[currentObject]->specularColor[0] = 0;
-    objects[currentObject]->specularColor[1] = 0;
-    objects[currentObject]->specularColor[2] = 0;
+    memset(material, 0, sizeof(Material));
   }
 
   if (objectType == LIGHT) {
-    lights[currentObject]->direction[0] = 0;
-    lights[currentObject]->direction[1] = 0;
-    lights[currentObject]->direction[2] = 0;
-    lights[currentObject]->radialAtten[0] = INFINITY;
-    lights[currentObject]->radialAtten[1] = INFINITY;
-    lights[currentObject]->radialAtten[2] = INFINITY;
-    lights[currentObject]->angularAtten = INFINITY;
-    lights[currentObject]->theta = 0;
+    light->direction[0] = 0;
+    light->direction[1] = 0;
+    light->direction[2] = 0;
+    light->radialAtten[0] = INFINITY;
+    light->radialAtten[1] = INFINITY;
+    light->radialAtten[2] = INFINITY;
+    light->angularAtten = INFINITY;
+    light->theta = 0;
   }
 
+  int isObject = objectType == PLANE || objectType == SPHERE;
   while (1) {
-    c = fnextc(json);
+    c = nextc(json);
     if (c == '}') {
       // Stop parsing this object
 
       if (objectType == LIGHT) {
-        if (lights[currentObject]->radialAtten[0] != INFINITY || lights[currentObject]->radialAtten[1] != INFINITY || lights[currentObject]->radialAtten[2] != INFINITY) {
-          if (lights[currentObject]->radialAtten[0] == INFINITY) {
-            lights[currentObject]->radialAtten[0] = 0;
-          }
-          if (lights[currentObject]->radialAtten[1] == INFINITY) {
-            lights[currentObject]->radialAtten[1] = 0;
-          }
-          if (lights[currentObject]->radialAtten[2] == INFINITY) {
-            lights[currentObject]->radialAtten[2] = 1;
-          }
-        }
+        fillRadialDefaults(light);
       }
       break;
     } else if (c == ',') {
       skipWhitespace(json);
-      char* key = nextString(json);
+      int length = nextString(json, &key);
       skipWhitespace(json);
-      fexpectc(json, ':');
+      expectc(json, ':');
       skipWhitespace(json);
 
-      if (strcmp(key, "width") == 0) {
-        if (objectType == CAMERA) {
-          double w = nextNumber(json);
+      switch (lookupKey(key, length)) {
+        case KEY_WIDTH: {
+          if (objectType != CAMERA) improperField(json);
+          real w = nextNumber(json);
           if (w > 0) {
-              camera[0]->width = w;
+            camera->width = w;
           } else {
-            fprintf(stderr, "Camera width must be greater than 0.\n");
-            exit(1);
+            parseError(json, "Camera width must be greater than 0.");
           }
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
+          break;
         }
-      } else if (strcmp(key, "height") == 0) {
-        if (objectType == CAMERA) {
-          double h = nextNumber(json);
+        case KEY_HEIGHT: {
+          if (objectType != CAMERA) improperField(json);
+          real h = nextNumber(json);
           if (h > 0) {
-              camera[0]->height = h;
+            camera->height = h;
           } else {
-            fprintf(stderr, "Camera height must be greater than 0.\n");
-            exit(1);
+            parseError(json, "Camera height must be greater than 0.");
           }
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
+          break;
         }
-      } else if (strcmp(key, "radius") == 0) {
-        if (objectType == SPHERE) {
-          double radius = nextNumber(json);
+        case KEY_RADIUS: {
+          if (objectType != SPHERE) improperField(json);
+          real radius = nextNumber(json);
           if (radius >= 0) {
-            objects[currentObject]->sphere.radius = radius;
+            object->sphere.radius = radius;
           } else {
-            fprintf(stderr, "Error: Radius cannot be less than 0.\n");
-            exit(1);
-          }
-        }  else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "color") == 0) {
-        if (objectType == LIGHT) {
-          double* v = nextVector(json);
-          for (int i = 0; i < 3; i++) {
-            lights[currentObject]->color[i] = v[i];
-          }
-          free(v);
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "diffuse_color") == 0) {
-        if (objectType == PLANE || objectType == SPHERE) {
-          double* v = nextVector(json);
-          for (int i = 0; i < 3; i++) {
-            objects[currentObject]->diffuseColor[i] = v[i];
-          }
-          free(v);
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      }  else if (strcmp(key, "specular_color") == 0) {
-        if (objectType == PLANE || objectType == SPHERE) {
-          double* v = nextVector(json);
-          for (int i = 0; i < 3; i++) {
-            objects[currentObject]->specularColor[i] = v[i];
-          }
-          free(v);
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "position") == 0) {
-        if (objectType == PLANE || objectType == SPHERE) {
-          double* v = nextVector(json);
-          for (int i = 0; i < 3; i++) {
-            objects[currentObject]->position[i] = v[i];
-          }
-          free(v);
-        } else if (objectType == LIGHT) {
-          double* v = nextVector(json);
-          for (int i = 0; i < 3; i++) {
-            lights[currentObject]->position[i] = v[i];
-          }
-          free(v);
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "normal") == 0) {
-        if (objectType == PLANE) {
-          double* v = nextVector(json);
-          normalize(v);
-          for (int i = 0; i < 3; i++) {
-            objects[currentObject]->plane.normal[i] = v[i];
+            parseError(json, "Radius cannot be less than 0.");
           }
-          free(v);
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
+          break;
         }
-      } else if (strcmp(key, "direction") == 0) {
-        if (objectType == LIGHT) {
-          double* v = nextVector(json);
-          normalize(v);
-          for (int i = 0; i < 3; i++) {
-            lights[currentObject]->direction[i] = v[i];
+        case KEY_COLOR:
+          if (objectType != LIGHT) improperField(json);
+          nextVector(json, light->color);
+          break;
+        case KEY_DIFFUSE_COLOR:
+          if (!isObject) improperField(json);
+          nextVector(json, material->diffuseColor);
+          break;
+        case KEY_SPECULAR_COLOR:
+          if (!isObject) improperField(json);
+          nextVector(json, material->specularColor);
+          break;
+        case KEY_POSITION:
+          if (isObject) {
+            nextVector(json, object->position);
+          } else if (objectType == LIGHT) {
+            nextVector(json, light->position);
+          } else {
+            improperField(json);
           }
-          free(v);
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "radial-a2") == 0) {
-        if (objectType == LIGHT) {
-          double rAtten2 = nextNumber(json);
-          lights[currentObject]->radialAtten[2] = rAtten2;
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "radial-a1") == 0) {
-        if (objectType == LIGHT) {
-          double rAtten1 = nextNumber(json);
-          lights[currentObject]->radialAtten[1] = rAtten1;
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "radial-a0") == 0) {
-        if (objectType == LIGHT) {
-          double rAtten0 = nextNumber(json);
-          lights[currentObject]->radialAtten[0] = rAtten0;
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "angular-a0") == 0) {
-        if (objectType == LIGHT) {
-          double aAtten = nextNumber(json);
-          lights[currentObject]->angularAtten = aAtten;
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else if (strcmp(key, "theta") == 0) {
-        if (objectType == LIGHT) {
-          double theta = nextNumber(json);
-          lights[currentObject]->theta = theta;
-        } else {
-          fprintf(stderr, "Error: Improper object field on line %d", line);
-          exit(1);
-        }
-      } else {
-        fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n", key, line);
-        exit(1);
+          break;
+        case KEY_NORMAL:
+          if (objectType != PLANE) improperField(json);
+          nextVector(json, object->plane.normal);
+          normalize(object->plane.normal);
+          break;
+        case KEY_DIRECTION:
+          if (objectType != LIGHT) improperField(json);
+          nextVector(json, light->direction);
+          normalize(light->direction);
+          break;
+        case KEY_RADIAL_A2:
+          if (objectType != LIGHT) improperField(json);
+          light->radialAtten[2] = nextNumber(json);
+          break;
+        case KEY_RADIAL_A1:
+          if (objectType != LIGHT) improperField(json);
+          light->radialAtten[1] = nextNumber(json);
+          break;
+        case KEY_RADIAL_A0:
+          if (objectType != LIGHT) improperField(json);
+          light->radialAtten[0] = nextNumber(json);
+          break;
+        case KEY_ANGULAR_A0:
+          if (objectType != LIGHT) improperField(json);
+          light->angularAtten = nextNumber(json);
+          break;
+        case KEY_THETA:
+          if (objectType != LIGHT) improperField(json);
+          light->theta = nextNumber(json);
+          break;
+        default:
+          parseError(json, "Unknown property, \"%.*s\", on line %d.", length, key, json->line);
       }
       skipWhitespace(json);
     } else {
-      fprintf(stderr, "Error: Unexpected value on line %d.\n", line);
-      exit(1);
+      parseError(json, "Unexpected value on line %d.", json->line);
     }
   }
 }
 
-void parseJSON(char* fileName) {
+// parseEntries parses the objects of a scene file into scene. A chunk
+// of a file parsed in parallel starts at an object instead of at the
+// '[' unless first is set, and ends right after an object instead of
+// at the ']' unless last is set.
+void parseEntries(Parser* json, Scene* scene, int first, int last) {
   int c;
-  FILE* json = fopen(fileName, "r");
-  camera[0] = NULL;
-
-  if (json == NULL) {
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", fileName);
-    exit(1);
-  }
+  const char* key;
+  const char* value;
 
-  skipWhitespace(json);
+  if (first) {
+    skipWhitespace(json);
 
-  // Find the beginning of the list
-  fexpectc(json, '[');
+    // Find the beginning of the list
+    expectc(json, '[');
 
-  skipWhitespace(json);
+    skipWhitespace(json);
+  }
 
-  int currentObject = 0;
-  int currentLight = 0;
   while (1) {
-    c = fnextc(json);
+    c = nextc(json);
     if (c == ']') {
-      fprintf(stderr, "Error: This is the worst scene file EVER.\n");
-      fclose(json);
-      return;
+      parseError(json, "This is the worst scene file EVER.");
     } else if (c == '{') {
       skipWhitespace(json);
 
       // Parse the object
-      char* key = nextString(json);
-      if (strcmp(key, "type") != 0) {
-        fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-        exit(1);
+      int length = nextString(json, &key);
+      if (length != 4 || memcmp(key, "type", 4) != 0) {
+        parseError(json, "Expected \"type\" key on line number %d.", json->line);
       }
 
       skipWhitespace(json);
 
-      fexpectc(json, ':');
+      expectc(json, ':');
 
       skipWhitespace(json);
 
-      char* value = nextString(json);
+      length = nextString(json, &value);
 
       skipWhitespace(json);
-      if (strcmp(value, "camera") == 0) {
-        if (camera[0] == NULL) {
-          camera[0] = malloc(sizeof(Camera));
-          parseObject(json, currentObject, CAMERA);
-        } else {
-          fprintf(stderr, "Error: There should only be one camera per scene.\n");
-          exit(1);
+      int kind = lookupType(value, length);
+      switch (kind) {
+        case CAMERA:
+          if (scene->camera == NULL) {
+            scene->camera = arenaAlloc(&scene->arena, sizeof(Camera));
+            parseObject(json, scene->camera, NULL, NULL, NULL, CAMERA);
+          } else {
+            parseError(json, "There should only be one camera per scene.");
+          }
+          break;
+        case SPHERE:
+        case PLANE: {
+          Object* object = addObject(scene);
+          Material material;
+          object->kind = kind;
+          parseObject(json, NULL, object, &material, NULL, kind);
+          object->material = internMaterial(&json->materials, &material);
+          if (object->material < 0) {
+            longjmp(*json->failure, RAYCAST_ERROR_MEMORY);
+          }
+          break;
         }
-      } else if (strcmp(value, "sphere") == 0) {
-        objects[currentObject] = malloc(sizeof(Object));
-        objects[currentObject]->kind = SPHERE;
-        parseObject(json, currentObject, SPHERE);
-        currentObject++;
-      } else if (strcmp(value, "plane") == 0) {
-        objects[currentObject] = malloc(sizeof(Object));
-        objects[currentObject]->kind = PLANE;
-        parseObject(json, currentObject, PLANE);
-        currentObject++;
-      } else if (strcmp(value, "light") == 0) {
-        lights[currentLight] = malloc(sizeof(Light));
-        parseObject(json, currentLight, LIGHT);
-        currentLight++;
-      } else {
-        fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-        exit(1);
+        case LIGHT:
+          parseObject(json, NULL, NULL, NULL, addLight(scene), LIGHT);
+          break;
+        default:
+          parseError(json, "Unknown type, \"%.*s\", on line number %d.", length, value, json->line);
       }
+      if (!last && json->p == json->end) return;
 
       skipWhitespace(json);
-      c = fnextc(json);
+      c = nextc(json);
       if (c == ',') {
         skipWhitespace(json);
-      } else if (c == ']') {
-        if (camera[0] == NULL) {
-          fprintf(stderr, "Error: Scene must contain a camera.\n");
-          exit(1);
-        }
-        objects[currentObject] = NULL;
-        lights[currentLight] = NULL;
-        fclose(json);
+      } else if (c == ']' && last) {
         return;
       } else {
-        fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
-        exit(1);
+        parseError(json, "Expecting ',' or ']' on line %d.", json->line);
       }
     } else {
-      fprintf(stderr, "Error: Expecting '{' on line %d.\n", line);
-      exit(1);
+      parseError(json, "Expecting '{' on line %d.", json->line);
     }
   }
 }
 
-double planeIntersection(const double* Ro, const double* Rd, const double* P, const double* N) {
-  double Vd = dot(N, Rd);
-  if (Vd == 0) return -1;
-  double dist[3] = {
-    P[0] - Ro[0],
-    P[1] - Ro[1],
-    P[2] - Ro[2]
-  };
-  double Vo = dot(dist, N);
-  double t = Vo / Vd;
-  if (t < 0) return -2;
-  return t;
+// parseBuffer parses a whole scene file that has been loaded into the
+// parser's buffer.
+void parseBuffer(Parser* json, Scene* scene) {
+  scene->camera = NULL;
+  parseEntries(json, scene, 1, 1);
+  if (scene->camera == NULL) {
+    parseError(json, "Scene must contain a camera.");
+  }
+  finishMaterials(scene, &json->materials);
 }
 
-double sphereIntersection(const double* Ro, const double* Rd, const double* P, double r) {
-  double A = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
-  double B = 2 * (Rd[0] * (Ro[0] - P[0]) + Rd[1] * (Ro[1] - P[1]) + Rd[2] * (Ro[2] - P[2]));
-  double C = sqr(Ro[0] - P[0]) + sqr(Ro[1] - P[1]) + sqr(Ro[2] - P[2]) - sqr(r);
+// parseScene parses the JSON scene in data[0, size) into scene. On
+// failure it fills in error and returns its status; the scene holds
+// whatever was read before the error and still has to be freed.
+RaycastStatus parseScene(const char* data, size_t size, Scene* scene, RaycastError* error) {
+  jmp_buf failure;
+  Parser json;
+  json.p = data;
+  json.end = data + size;
+  json.line = 1;
+  memset(&json.materials, 0, sizeof(json.materials));
+  json.error = error;
+  json.failure = &failure;
+  scene->arena.failure = &failure;
 
-  double det = sqr(B) - 4 * A * C;
-  if (det < 0) return -1;
-  det = sqrt(det);
-  double t0 = (-B - det) / (2 * A);
-  if (t0 > 0) return t0;
+  error->status = setjmp(failure);
+  if (error->status != RAYCAST_OK) {
+    if (error->status == RAYCAST_ERROR_MEMORY) {
+      snprintf(error->message, sizeof(error->message), "Out of memory.");
+      error->line = 0;
+    }
+    free(json.materials.materials);
+    free(json.materials.slots);
+    scene->arena.failure = NULL;
+    return error->status;
+  }
+  parseBuffer(&json, scene);
+  scene->arena.failure = NULL;
+  return RAYCAST_OK;
+}
+
+// Files are only parsed in parallel when every thread gets at least
+// this many bytes.
+#define PARSE_CHUNK_MIN (1 << 22)
+
+// ParseChunk is one thread's share of a scene file parsed in parallel.
+typedef struct {
+  const char* start;
+  const char* end;
+  int first;
+  int last;
+  Scene scene;             // the chunk's camera, objects and lights
+  MaterialTable materials; // materials of the chunk's objects
+  RaycastStatus status;
+  int* remap;              // chunk material index to scene material index
+  Object* objects;         // where the merge copies the chunk's objects to
+  Light* lights;
+} ParseChunk;
+
+static inline int isJSONSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// findObjectBoundary returns the first '}' at or after p that is
+// followed by a ',' and a '{', and points *next at that '{'. Returns
+// NULL if there is none before end. Objects have no nested objects and
+// valid strings hold no braces, so in a valid scene the '{' starts a
+// top-level object; chunks split anywhere else fail to parse.
+const char* findObjectBoundary(const char* p, const char* end, const char** next) {
+  while ((p = memchr(p, '}', end - p)) != NULL) {
+    const char* q = p + 1;
+    while (q < end && isJSONSpace(*q)) q++;
+    if (q < end && *q == ',') {
+      q++;
+      while (q < end && isJSONSpace(*q)) q++;
+      if (q < end && *q == '{') {
+        *next = q;
+        return p;
+      }
+    }
+    p++;
+  }
+  return NULL;
+}
+
+void* parseChunk(void* arg) {
+  ParseChunk* chunk = arg;
+  jmp_buf failure;
+  RaycastError error;
+  Parser json;
+  json.p = chunk->start;
+  json.end = chunk->end;
+  json.line = 1;
+  memset(&json.materials, 0, sizeof(json.materials));
+  json.error = &error;
+  json.failure = &failure;
+  chunk->scene.arena.failure = &failure;
+
+  chunk->status = setjmp(failure);
+  if (chunk->status == RAYCAST_OK) {
+    parseEntries(&json, &chunk->scene, chunk->first, chunk->last);
+  }
+  chunk->scene.arena.failure = NULL;
+  chunk->materials = json.materials;
+  return NULL;
+}
+
+// mergeChunk copies a parsed chunk's objects and lights into the scene.
+void* mergeChunk(void* arg) {
+  ParseChunk* chunk = arg;
+  const Scene* part = &chunk->scene;
+  for (int i = 0; i < part->objectCount; i++) {
+    chunk->objects[i] = part->objects[i];
+    chunk->objects[i].material = chunk->remap[part->objects[i].material];
+  }
+  memcpy(chunk->lights, part->lights, sizeof(Light) * part->lightCount);
+  return NULL;
+}
+
+// runChunks calls task on every chunk, each on its own thread. Chunks
+// whose thread cannot be started are run on this one.
+void runChunks(ParseChunk* chunks, int count, void* (*task)(void*)) {
+  pthread_t* threads = malloc(sizeof(pthread_t) * count);
+  int* started = calloc(count, sizeof(int));
+  for (int i = 1; threads != NULL && started != NULL && i < count; i++) {
+    started[i] = pthread_create(&threads[i], NULL, task, &chunks[i]) == 0;
+  }
+  task(&chunks[0]);
+  for (int i = 1; i < count; i++) {
+    if (started != NULL && started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      task(&chunks[i]);
+    }
+  }
+  free(started);
+  free(threads);
+}
+
+// parseSceneThreads parses like parseScene(), splitting a large file
+// into chunks at object boundaries that are parsed on up to threads
+// threads and then merged in file order. The scene renders the same as
+// one parsed in a single pass, though materials shared only between
+// chunks may be stored more than once. Any error, including a second
+// camera in another chunk, parses the file again with parseScene() so
+// that the message and its line number are exactly the same.
+RaycastStatus parseSceneThreads(const char* data, size_t size, Scene* scene, RaycastError* error, int threads) {
+  size_t maxChunks = size / PARSE_CHUNK_MIN;
+  if (threads > 1 && (size_t)threads < maxChunks) maxChunks = threads;
+  if (threads <= 1 || maxChunks < 2) {
+    return parseScene(data, size, scene, error);
+  }
+
+  ParseChunk* chunks = calloc(maxChunks, sizeof(ParseChunk));
+  if (chunks == NULL) {
+    return parseScene(data, size, scene, error);
+  }
+  const char* end = data + size;
+  const char* start = data;
+  int count = 0;
+  for (size_t i = 1; i < maxChunks; i++) {
+    const char* target = data + size / maxChunks * i;
+    if (target < start) continue;
+    const char* next;
+    const char* close = findObjectBoundary(target, end, &next);
+    if (close == NULL) break;
+    chunks[count].start = start;
+    chunks[count].end = close + 1;
+    chunks[count].first = count == 0;
+    count++;
+    start = next;
+  }
+  chunks[count].start = start;
+  chunks[count].end = end;
+  chunks[count].first = count == 0;
+  chunks[count].last = 1;
+  count++;
+
+  for (int i = 0; i < count; i++) {
+    initScene(&chunks[i].scene);
+  }
+  runChunks(chunks, count, parseChunk);
+
+  int valid = 1;
+  int cameras = 0;
+  int objectCount = 0;
+  int lightCount = 0;
+  for (int i = 0; i < count; i++) {
+    if (chunks[i].status != RAYCAST_OK) valid = 0;
+    if (chunks[i].scene.camera != NULL) cameras++;
+    objectCount += chunks[i].scene.objectCount;
+    lightCount += chunks[i].scene.lightCount;
+  }
+
+  if (valid && cameras == 1) {
+    scene->camera = arenaAlloc(&scene->arena, sizeof(Camera));
+    if (objectCount > 0) {
+      scene->objects = arenaAlloc(&scene->arena, sizeof(Object) * objectCount);
+    }
+    scene->objectCount = objectCount;
+    scene->objectCapacity = objectCount;
+    if (lightCount > 0) {
+      scene->lights = arenaAlloc(&scene->arena, sizeof(Light) * lightCount);
+    }
+    scene->lightCount = lightCount;
+    scene->lightCapacity = lightCount;
+
+    // Materials are interned again in file order so that chunks share
+    // the ones they have in common where the table still looks them up.
+    MaterialTable materials;
+    memset(&materials, 0, sizeof(materials));
+    Object* objects = scene->objects;
+    Light* lights = scene->lights;
+    for (int i = 0; i < count; i++) {
+      ParseChunk* chunk = &chunks[i];
+      if (chunk->scene.camera != NULL) {
+        *scene->camera = *chunk->scene.camera;
+      }
+      chunk->remap = malloc(sizeof(int) * (chunk->materials.count + 1));
+      if (chunk->remap == NULL) {
+        outOfMemory(scene->arena.failure);
+      }
+      for (int m = 0; m < chunk->materials.count; m++) {
+        chunk->remap[m] = internMaterial(&materials, &chunk->materials.materials[m]);
+        if (chunk->remap[m] < 0) {
+          outOfMemory(scene->arena.failure);
+        }
+      }
+      chunk->objects = objects;
+      chunk->lights = lights;
+      objects += chunk->scene.objectCount;
+      lights += chunk->scene.lightCount;
+    }
+    finishMaterials(scene, &materials);
+    runChunks(chunks, count, mergeChunk);
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(chunks[i].materials.materials);
+    free(chunks[i].materials.slots);
+    free(chunks[i].remap);
+    freeScene(&chunks[i].scene);
+  }
+  free(chunks);
+
+  if (!valid || cameras != 1) {
+    return parseScene(data, size, scene, error);
+  }
+  error->status = RAYCAST_OK;
+  return RAYCAST_OK;
+}
+
+// parseFile parses the JSON scene in data[0, size) into scene with up
+// to scene->parseThreads threads, exiting with the parser's message if
+// it is not valid.
+void parseFile(const char* data, size_t size, Scene* scene) {
+  RaycastError error;
+  if (parseSceneThreads(data, size, scene, &error, scene->parseThreads) != RAYCAST_OK) {
+    fprintf(stderr, "Error: %s\n", error.message);
+    exit(1);
+  }
+}
+
+void parseJSON(char* fileName, Scene* scene) {
+  MappedFile file;
+  if (!mapFile(fileName, &file)) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", fileName);
+    exit(1);
+  }
+  parseFile(file.data, file.size, scene);
+  unmapFile(&file);
+}
+
+real planeIntersection(const real* Ro, const real* Rd, const real* P, const real* N) {
+  real Vd = dot(N, Rd);
+  if (Vd == 0) return -1;
+  real dist[3] = {
+    P[0] - Ro[0],
+    P[1] - Ro[1],
+    P[2] - Ro[2]
+  };
+  real Vo = dot(dist, N);
+  real t = Vo / Vd;
+  if (t < 0) return -2;
+  return t;
+}
+
+real sphereIntersection(const real* Ro, const real* Rd, const real* P, real r) {
+  real A = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  real B = 2 * (Rd[0] * (Ro[0] - P[0]) + Rd[1] * (Ro[1] - P[1]) + Rd[2] * (Ro[2] - P[2]));
+  real C = sqr(Ro[0] - P[0]) + sqr(Ro[1] - P[1]) + sqr(Ro[2] - P[2]) - sqr(r);
+
+  real det = sqr(B) - 4 * A * C;
+  if (det < 0) return -1;
+  det = sqrt(det);
+  real t0 = (-B - det) / (2 * A);
+  if (t0 > 0) return t0;
+
+  real t1 = (-B + det) / (2 * A);
+  if (t1 > 0) return t1;
+
+  return -1;
+}
+
+real radialAttenuation(real a2, real a1, real a0, real d) {
+  real quotient = a2 * sqr(d) + a1 * d + a0;
+  if (quotient == 0) {
+    return 0;
+  }
+  if (d == INFINITY) {
+    return 1;
+  } else {
+    return 1.0 / quotient;
+  }
+}
+
+static inline void aabbEmpty(AABB* box) {
+  for (int i = 0; i < 3; i++) {
+    box->min[i] = INFINITY;
+    box->max[i] = -INFINITY;
+  }
+}
+
+static inline void aabbGrow(AABB* box, const AABB* other) {
+  for (int i = 0; i < 3; i++) {
+    if (other->min[i] < box->min[i]) box->min[i] = other->min[i];
+    if (other->max[i] > box->max[i]) box->max[i] = other->max[i];
+  }
+}
+
+static inline void aabbGrowPoint(AABB* box, const real* p) {
+  for (int i = 0; i < 3; i++) {
+    if (p[i] < box->min[i]) box->min[i] = p[i];
+    if (p[i] > box->max[i]) box->max[i] = p[i];
+  }
+}
+
+static inline real aabbArea(const AABB* box) {
+  real dx = box->max[0] - box->min[0];
+  real dy = box->max[1] - box->min[1];
+  real dz = box->max[2] - box->min[2];
+  if (dx < 0 || dy < 0 || dz < 0) return 0;
+  return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+// aabbRayInterval clips the ray against the box and returns 0 if the
+// ray misses it. tNear and tFar receive the parametric entry and exit.
+static inline int aabbRayInterval(const AABB* box, const real* Ro, const real* Rd, real* tNear, real* tFar) {
+  real t0 = -INFINITY;
+  real t1 = INFINITY;
+  for (int i = 0; i < 3; i++) {
+    if (Rd[i] == 0) {
+      if (Ro[i] < box->min[i] || Ro[i] > box->max[i]) return 0;
+      continue;
+    }
+    real inv = 1.0 / Rd[i];
+    real ta = (box->min[i] - Ro[i]) * inv;
+    real tb = (box->max[i] - Ro[i]) * inv;
+    if (ta > tb) {
+      real swap = ta;
+      ta = tb;
+      tb = swap;
+    }
+    if (ta > t0) t0 = ta;
+    if (tb < t1) t1 = tb;
+    if (t0 > t1) return 0;
+  }
+  *tNear = t0;
+  *tFar = t1;
+  return 1;
+}
+
+// The intersection kernels test one ray against a run of spheres or
+// planes stored component-by-component and write one t per object,
+// using the same conventions as sphereIntersection() and
+// planeIntersection(). Every kernel performs the same floating point
+// operations in the same order, so they produce identical results.
+
+void sphereKernelScalar(const SphereSoA* s, int first, int count, const real* Ro, const real* Rd, real* t) {
+  real A = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  real A2 = 2 * A;
+  real A4 = 4 * A;
+  for (int i = 0; i < count; i++) {
+    int k = first + i;
+    real dx = Ro[0] - s->x[k];
+    real dy = Ro[1] - s->y[k];
+    real dz = Ro[2] - s->z[k];
+    real B = 2 * (Rd[0] * dx + Rd[1] * dy + Rd[2] * dz);
+    real C = sqr(dx) + sqr(dy) + sqr(dz) - s->r2[k];
+    real det = sqr(B) - A4 * C;
+    t[i] = -1;
+    if (det < 0) continue;
+    det = sqrt(det);
+    real t0 = (-B - det) / A2;
+    real t1 = (-B + det) / A2;
+    if (t0 > 0) {
+      t[i] = t0;
+    } else if (t1 > 0) {
+      t[i] = t1;
+    }
+  }
+}
+
+void planeKernelScalar(const PlaneSoA* p, int first, int count, const real* Ro, const real* Rd, real* t) {
+  for (int i = 0; i < count; i++) {
+    int k = first + i;
+    real Vd = p->nx[k] * Rd[0] + p->ny[k] * Rd[1] + p->nz[k] * Rd[2];
+    if (Vd == 0) {
+      t[i] = -1;
+      continue;
+    }
+    real Vo = (p->px[k] - Ro[0]) * p->nx[k] + (p->py[k] - Ro[1]) * p->ny[k] + (p->pz[k] - Ro[2]) * p->nz[k];
+    t[i] = Vo / Vd;
+    if (t[i] < 0) t[i] = -2;
+  }
+}
+
+#ifdef RAYCAST_X86
+
+// Vector types and intrinsics for the current real type: SIMD(_mm_add)
+// is _mm_add_pd for double and _mm_add_ps for float.
+#ifdef RAYCAST_FLOAT
+typedef __m128 v128;
+typedef __m256 v256;
+#define SIMD(op) op##_ps
+#else
+typedef __m128d v128;
+typedef __m256d v256;
+#define SIMD(op) op##_pd
+#endif
+#define SSE_WIDTH (16 / (int)sizeof(real))
+#define AVX_WIDTH (32 / (int)sizeof(real))
+
+int kernelSupportedSSE2() {
+  return __builtin_cpu_supports("sse2");
+}
+
+void sphereKernelSSE2(const SphereSoA* s, int first, int count, const real* Ro, const real* Rd, real* t) {
+  real A = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  v128 A2 = SIMD(_mm_set1)(2 * A);
+  v128 A4 = SIMD(_mm_set1)(4 * A);
+  v128 ox = SIMD(_mm_set1)(Ro[0]), oy = SIMD(_mm_set1)(Ro[1]), oz = SIMD(_mm_set1)(Ro[2]);
+  v128 rx = SIMD(_mm_set1)(Rd[0]), ry = SIMD(_mm_set1)(Rd[1]), rz = SIMD(_mm_set1)(Rd[2]);
+  v128 two = SIMD(_mm_set1)(2);
+  v128 zero = SIMD(_mm_setzero)();
+  v128 miss = SIMD(_mm_set1)(-1);
+  v128 sign = SIMD(_mm_set1)(-0.0);
+
+  for (int i = 0; i < count; i += SSE_WIDTH) {
+    int k = first + i;
+    v128 dx = SIMD(_mm_sub)(ox, SIMD(_mm_loadu)(s->x + k));
+    v128 dy = SIMD(_mm_sub)(oy, SIMD(_mm_loadu)(s->y + k));
+    v128 dz = SIMD(_mm_sub)(oz, SIMD(_mm_loadu)(s->z + k));
+    v128 B = SIMD(_mm_add)(SIMD(_mm_add)(SIMD(_mm_mul)(rx, dx), SIMD(_mm_mul)(ry, dy)), SIMD(_mm_mul)(rz, dz));
+    B = SIMD(_mm_mul)(two, B);
+    v128 C = SIMD(_mm_add)(SIMD(_mm_add)(SIMD(_mm_mul)(dx, dx), SIMD(_mm_mul)(dy, dy)), SIMD(_mm_mul)(dz, dz));
+    C = SIMD(_mm_sub)(C, SIMD(_mm_loadu)(s->r2 + k));
+    v128 det = SIMD(_mm_sub)(SIMD(_mm_mul)(B, B), SIMD(_mm_mul)(A4, C));
+    v128 hit = SIMD(_mm_cmpge)(det, zero);
+    if (SIMD(_mm_movemask)(hit) == 0) {
+      SIMD(_mm_storeu)(t + i, miss);
+      continue;
+    }
+    det = SIMD(_mm_sqrt)(det);
+    v128 negB = SIMD(_mm_xor)(B, sign);
+    v128 t0 = SIMD(_mm_div)(SIMD(_mm_sub)(negB, det), A2);
+    v128 t1 = SIMD(_mm_div)(SIMD(_mm_add)(negB, det), A2);
+    v128 use0 = SIMD(_mm_cmpgt)(t0, zero);
+    v128 use1 = SIMD(_mm_cmpgt)(t1, zero);
+    v128 result = SIMD(_mm_or)(SIMD(_mm_and)(use1, t1), SIMD(_mm_andnot)(use1, miss));
+    result = SIMD(_mm_or)(SIMD(_mm_and)(use0, t0), SIMD(_mm_andnot)(use0, result));
+    result = SIMD(_mm_or)(SIMD(_mm_and)(hit, result), SIMD(_mm_andnot)(hit, miss));
+    SIMD(_mm_storeu)(t + i, result);
+  }
+}
+
+void planeKernelSSE2(const PlaneSoA* p, int first, int count, const real* Ro, const real* Rd, real* t) {
+  v128 ox = SIMD(_mm_set1)(Ro[0]), oy = SIMD(_mm_set1)(Ro[1]), oz = SIMD(_mm_set1)(Ro[2]);
+  v128 rx = SIMD(_mm_set1)(Rd[0]), ry = SIMD(_mm_set1)(Rd[1]), rz = SIMD(_mm_set1)(Rd[2]);
+  v128 zero = SIMD(_mm_setzero)();
+  v128 parallel = SIMD(_mm_set1)(-1);
+  v128 behind = SIMD(_mm_set1)(-2);
+
+  for (int i = 0; i < count; i += SSE_WIDTH) {
+    int k = first + i;
+    v128 nx = SIMD(_mm_loadu)(p->nx + k);
+    v128 ny = SIMD(_mm_loadu)(p->ny + k);
+    v128 nz = SIMD(_mm_loadu)(p->nz + k);
+    v128 Vd = SIMD(_mm_add)(SIMD(_mm_add)(SIMD(_mm_mul)(nx, rx), SIMD(_mm_mul)(ny, ry)), SIMD(_mm_mul)(nz, rz));
+    v128 Vo = SIMD(_mm_add)(SIMD(_mm_add)(
+      SIMD(_mm_mul)(SIMD(_mm_sub)(SIMD(_mm_loadu)(p->px + k), ox), nx),
+      SIMD(_mm_mul)(SIMD(_mm_sub)(SIMD(_mm_loadu)(p->py + k), oy), ny)),
+      SIMD(_mm_mul)(SIMD(_mm_sub)(SIMD(_mm_loadu)(p->pz + k), oz), nz));
+    v128 result = SIMD(_mm_div)(Vo, Vd);
+    v128 negative = SIMD(_mm_cmplt)(result, zero);
+    result = SIMD(_mm_or)(SIMD(_mm_and)(negative, behind), SIMD(_mm_andnot)(negative, result));
+    v128 flat = SIMD(_mm_cmpeq)(Vd, zero);
+    result = SIMD(_mm_or)(SIMD(_mm_and)(flat, parallel), SIMD(_mm_andnot)(flat, result));
+    SIMD(_mm_storeu)(t + i, result);
+  }
+}
+
+int kernelSupportedAVX2() {
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+void sphereKernelAVX2(const SphereSoA* s, int first, int count, const real* Ro, const real* Rd, real* t) {
+  real A = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+  v256 A2 = SIMD(_mm256_set1)(2 * A);
+  v256 A4 = SIMD(_mm256_set1)(4 * A);
+  v256 ox = SIMD(_mm256_set1)(Ro[0]), oy = SIMD(_mm256_set1)(Ro[1]), oz = SIMD(_mm256_set1)(Ro[2]);
+  v256 rx = SIMD(_mm256_set1)(Rd[0]), ry = SIMD(_mm256_set1)(Rd[1]), rz = SIMD(_mm256_set1)(Rd[2]);
+  v256 two = SIMD(_mm256_set1)(2);
+  v256 zero = SIMD(_mm256_setzero)();
+  v256 miss = SIMD(_mm256_set1)(-1);
+  v256 sign = SIMD(_mm256_set1)(-0.0);
+
+  for (int i = 0; i < count; i += AVX_WIDTH) {
+    int k = first + i;
+    v256 dx = SIMD(_mm256_sub)(ox, SIMD(_mm256_loadu)(s->x + k));
+    v256 dy = SIMD(_mm256_sub)(oy, SIMD(_mm256_loadu)(s->y + k));
+    v256 dz = SIMD(_mm256_sub)(oz, SIMD(_mm256_loadu)(s->z + k));
+    v256 B = SIMD(_mm256_add)(SIMD(_mm256_add)(SIMD(_mm256_mul)(rx, dx), SIMD(_mm256_mul)(ry, dy)), SIMD(_mm256_mul)(rz, dz));
+    B = SIMD(_mm256_mul)(two, B);
+    v256 C = SIMD(_mm256_add)(SIMD(_mm256_add)(SIMD(_mm256_mul)(dx, dx), SIMD(_mm256_mul)(dy, dy)), SIMD(_mm256_mul)(dz, dz));
+    C = SIMD(_mm256_sub)(C, SIMD(_mm256_loadu)(s->r2 + k));
+    v256 det = SIMD(_mm256_sub)(SIMD(_mm256_mul)(B, B), SIMD(_mm256_mul)(A4, C));
+    v256 hit = SIMD(_mm256_cmp)(det, zero, _CMP_GE_OQ);
+    if (SIMD(_mm256_movemask)(hit) == 0) {
+      SIMD(_mm256_storeu)(t + i, miss);
+      continue;
+    }
+    det = SIMD(_mm256_sqrt)(det);
+    v256 negB = SIMD(_mm256_xor)(B, sign);
+    v256 t0 = SIMD(_mm256_div)(SIMD(_mm256_sub)(negB, det), A2);
+    v256 t1 = SIMD(_mm256_div)(SIMD(_mm256_add)(negB, det), A2);
+    v256 result = SIMD(_mm256_blendv)(miss, t1, SIMD(_mm256_cmp)(t1, zero, _CMP_GT_OQ));
+    result = SIMD(_mm256_blendv)(result, t0, SIMD(_mm256_cmp)(t0, zero, _CMP_GT_OQ));
+    result = SIMD(_mm256_blendv)(miss, result, hit);
+    SIMD(_mm256_storeu)(t + i, result);
+  }
+}
+
+__attribute__((target("avx2")))
+void planeKernelAVX2(const PlaneSoA* p, int first, int count, const real* Ro, const real* Rd, real* t) {
+  v256 ox = SIMD(_mm256_set1)(Ro[0]), oy = SIMD(_mm256_set1)(Ro[1]), oz = SIMD(_mm256_set1)(Ro[2]);
+  v256 rx = SIMD(_mm256_set1)(Rd[0]), ry = SIMD(_mm256_set1)(Rd[1]), rz = SIMD(_mm256_set1)(Rd[2]);
+  v256 zero = SIMD(_mm256_setzero)();
+  v256 parallel = SIMD(_mm256_set1)(-1);
+  v256 behind = SIMD(_mm256_set1)(-2);
+
+  for (int i = 0; i < count; i += AVX_WIDTH) {
+    int k = first + i;
+    v256 nx = SIMD(_mm256_loadu)(p->nx + k);
+    v256 ny = SIMD(_mm256_loadu)(p->ny + k);
+    v256 nz = SIMD(_mm256_loadu)(p->nz + k);
+    v256 Vd = SIMD(_mm256_add)(SIMD(_mm256_add)(SIMD(_mm256_mul)(nx, rx), SIMD(_mm256_mul)(ny, ry)), SIMD(_mm256_mul)(nz, rz));
+    v256 Vo = SIMD(_mm256_add)(SIMD(_mm256_add)(
+      SIMD(_mm256_mul)(SIMD(_mm256_sub)(SIMD(_mm256_loadu)(p->px + k), ox), nx),
+      SIMD(_mm256_mul)(SIMD(_mm256_sub)(SIMD(_mm256_loadu)(p->py + k), oy), ny)),
+      SIMD(_mm256_mul)(SIMD(_mm256_sub)(SIMD(_mm256_loadu)(p->pz + k), oz), nz));
+    v256 result = SIMD(_mm256_div)(Vo, Vd);
+    result = SIMD(_mm256_blendv)(result, behind, SIMD(_mm256_cmp)(result, zero, _CMP_LT_OQ));
+    result = SIMD(_mm256_blendv)(result, parallel, SIMD(_mm256_cmp)(Vd, zero, _CMP_EQ_OQ));
+    SIMD(_mm256_storeu)(t + i, result);
+  }
+}
+
+#endif
+
+int kernelSupportedAlways() {
+  return 1;
+}
+
+// Kernels in order of preference; selectKernel() picks the first one
+// the CPU supports.
+const IntersectKernel kernels[] = {
+#ifdef RAYCAST_X86
+  { "avx2", kernelSupportedAVX2, sphereKernelAVX2, planeKernelAVX2 },
+  { "sse2", kernelSupportedSSE2, sphereKernelSSE2, planeKernelSSE2 },
+#endif
+  { "scalar", kernelSupportedAlways, sphereKernelScalar, planeKernelScalar },
+};
+
+#define KERNEL_COUNT ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+// selectKernel returns the named kernel, or the fastest supported one
+// if name is NULL. Returns NULL if the kernel is unknown or unsupported.
+const IntersectKernel* selectKernel(const char* name) {
+  for (int i = 0; i < KERNEL_COUNT; i++) {
+    if (name != NULL && strcmp(name, kernels[i].name) != 0) continue;
+    if (kernels[i].supported()) return &kernels[i];
+    if (name != NULL) return NULL;
+  }
+  return NULL;
+}
+
+// Arrays are padded to a whole number of the widest vectors, and the
+// padding is NaN so it never reports a hit.
+real* allocLanes(Arena* arena, int count) {
+  int padded = (count + KERNEL_WIDTH - 1) / KERNEL_WIDTH * KERNEL_WIDTH + KERNEL_WIDTH;
+  real* lanes = arenaAlloc(arena, sizeof(real) * padded);
+  for (int i = count; i < padded; i++) {
+    lanes[i] = NAN;
+  }
+  return lanes;
+}
+
+void allocSphereSoA(Arena* arena, SphereSoA* s, int count) {
+  s->x = allocLanes(arena, count);
+  s->y = allocLanes(arena, count);
+  s->z = allocLanes(arena, count);
+  s->r2 = allocLanes(arena, count);
+}
+
+void allocPlaneSoA(Arena* arena, PlaneSoA* p, int count) {
+  p->px = allocLanes(arena, count);
+  p->py = allocLanes(arena, count);
+  p->pz = allocLanes(arena, count);
+  p->nx = allocLanes(arena, count);
+  p->ny = allocLanes(arena, count);
+  p->nz = allocLanes(arena, count);
+}
+
+// sphereBounds returns the box around a sphere, padded slightly so
+// grazing rays that sphereIntersection() accepts through rounding are
+// never culled by the box test.
+void sphereBounds(const Object* sphere, AABB* box) {
+  real r = sphere->sphere.radius;
+  for (int i = 0; i < 3; i++) {
+    real pad = 1e-6 * (fabs(sphere->position[i]) + r) + 1e-9;
+    box->min[i] = sphere->position[i] - r - pad;
+    box->max[i] = sphere->position[i] + r + pad;
+  }
+}
+
+typedef struct {
+  AABB box;
+  real centroid[3];
+  int index;
+} BVHRef;
+
+typedef struct {
+  BVHRef* refs;
+  BVHNode* nodes;
+  int nodeCount;
+} BVHBuilder;
+
+// partitionRefs splits refs[first, first + count) using binned SAH and
+// returns the number of refs in the left half, or 0 if the range should
+// become a leaf. The split axis is stored in *splitAxis.
+int partitionRefs(BVHBuilder* b, int first, int count, int* splitAxis) {
+  if (count <= BVH_LEAF_SIZE) return 0;
+
+  AABB centroids;
+  aabbEmpty(&centroids);
+  for (int i = first; i < first + count; i++) {
+    aabbGrowPoint(&centroids, b->refs[i].centroid);
+  }
+
+  int axis = 0;
+  for (int i = 1; i < 3; i++) {
+    if (centroids.max[i] - centroids.min[i] > centroids.max[axis] - centroids.min[axis]) {
+      axis = i;
+    }
+  }
+  *splitAxis = axis;
+  real lo = centroids.min[axis];
+  real extent = centroids.max[axis] - lo;
+  if (extent <= 0) {
+    // Every centroid is in the same place; split by count instead.
+    return count / 2;
+  }
+
+  AABB binBoxes[BVH_BINS];
+  int binCounts[BVH_BINS];
+  for (int i = 0; i < BVH_BINS; i++) {
+    aabbEmpty(&binBoxes[i]);
+    binCounts[i] = 0;
+  }
+  real binScale = BVH_BINS / extent;
+  for (int i = first; i < first + count; i++) {
+    int bin = (int)((b->refs[i].centroid[axis] - lo) * binScale);
+    if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+    binCounts[bin]++;
+    aabbGrow(&binBoxes[bin], &b->refs[i].box);
+  }
+
+  // Sweep from the right to get the cost of every right-hand side,
+  // then from the left to find the cheapest split plane.
+  real rightArea[BVH_BINS];
+  int rightCount[BVH_BINS];
+  AABB acc;
+  aabbEmpty(&acc);
+  int n = 0;
+  for (int i = BVH_BINS - 1; i > 0; i--) {
+    aabbGrow(&acc, &binBoxes[i]);
+    n += binCounts[i];
+    rightArea[i] = aabbArea(&acc);
+    rightCount[i] = n;
+  }
+
+  real bestCost = INFINITY;
+  int bestBin = -1;
+  aabbEmpty(&acc);
+  n = 0;
+  for (int i = 0; i < BVH_BINS - 1; i++) {
+    aabbGrow(&acc, &binBoxes[i]);
+    n += binCounts[i];
+    if (n == 0 || rightCount[i + 1] == 0) continue;
+    real cost = aabbArea(&acc) * n + rightArea[i + 1] * rightCount[i + 1];
+    if (cost < bestCost) {
+      bestCost = cost;
+      bestBin = i;
+    }
+  }
+  if (bestBin < 0) return count / 2;
+
+  int i = first;
+  int j = first + count - 1;
+  while (i <= j) {
+    int bin = (int)((b->refs[i].centroid[axis] - lo) * binScale);
+    if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+    if (bin <= bestBin) {
+      i++;
+    } else {
+      BVHRef swap = b->refs[i];
+      b->refs[i] = b->refs[j];
+      b->refs[j] = swap;
+      j--;
+    }
+  }
+  int split = i - first;
+  if (split == 0 || split == count) return count / 2;
+  return split;
+}
+
+int buildNode(BVHBuilder* b, int first, int count, int depth) {
+  int index = b->nodeCount++;
+  BVHNode* node = &b->nodes[index];
+
+  AABB bounds;
+  aabbEmpty(&bounds);
+  for (int i = first; i < first + count; i++) {
+    aabbGrow(&bounds, &b->refs[i].box);
+  }
+  node->box = bounds;
+
+  int axis = 0;
+  int split = depth < BVH_MAX_DEPTH ? partitionRefs(b, first, count, &axis) : 0;
+  if (split == 0) {
+    node->offset = first;
+    node->count = count;
+    return index;
+  }
+
+  node->count = 0;
+  node->axis = axis;
+  buildNode(b, first, split, depth + 1);
+  node->offset = buildNode(b, first + split, count - split, depth + 1);
+  return index;
+}
+
+// buildBVH builds the bounding volume hierarchy over every sphere in the
+// scene and collects the planes, which have no finite bounds, into a
+// separate list. Calling it again replaces the previous build.
+void buildBVH(Scene* scene) {
+  arenaReset(&scene->accelArena);
+
+  int sphereCount = 0;
+  int planeCount = 0;
+  for (int i = 0; i < scene->objectCount; i++) {
+    if (scene->objects[i].kind == SPHERE) {
+      sphereCount++;
+    } else {
+      planeCount++;
+    }
+  }
+
+  scene->planes = arenaAlloc(&scene->accelArena, sizeof(int) * (planeCount + 1));
+  scene->planeCount = 0;
+  scene->spheres = arenaAlloc(&scene->accelArena, sizeof(int) * (sphereCount + 1));
+  scene->sphereCount = sphereCount;
+  scene->nodes = arenaAlloc(&scene->accelArena, sizeof(BVHNode) * (2 * sphereCount + 1));
+  scene->nodeCount = 0;
+
+  BVHBuilder b;
+  b.refs = malloc(sizeof(BVHRef) * (sphereCount + 1));
+  if (b.refs == NULL) {
+    outOfMemory(scene->accelArena.failure);
+  }
+  b.nodes = scene->nodes;
+  b.nodeCount = 0;
+
+  int n = 0;
+  for (int i = 0; i < scene->objectCount; i++) {
+    Object* object = &scene->objects[i];
+    if (object->kind == SPHERE) {
+      sphereBounds(object, &b.refs[n].box);
+      for (int j = 0; j < 3; j++) {
+        b.refs[n].centroid[j] = object->position[j];
+      }
+      b.refs[n].index = i;
+      n++;
+    } else {
+      scene->planes[scene->planeCount++] = i;
+    }
+  }
+
+  if (sphereCount > 0) {
+    buildNode(&b, 0, sphereCount, 0);
+  }
+  scene->nodeCount = b.nodeCount;
+  for (int i = 0; i < sphereCount; i++) {
+    scene->spheres[i] = b.refs[i].index;
+  }
+  free(b.refs);
+
+  allocSphereSoA(&scene->accelArena, &scene->sphereSoA, sphereCount);
+  for (int i = 0; i < sphereCount; i++) {
+    Object* sphere = &scene->objects[scene->spheres[i]];
+    scene->sphereSoA.x[i] = sphere->position[0];
+    scene->sphereSoA.y[i] = sphere->position[1];
+    scene->sphereSoA.z[i] = sphere->position[2];
+    scene->sphereSoA.r2[i] = sqr(sphere->sphere.radius);
+  }
+  allocPlaneSoA(&scene->accelArena, &scene->planeSoA, scene->planeCount);
+  for (int i = 0; i < scene->planeCount; i++) {
+    Object* plane = &scene->objects[scene->planes[i]];
+    scene->planeSoA.px[i] = plane->position[0];
+    scene->planeSoA.py[i] = plane->position[1];
+    scene->planeSoA.pz[i] = plane->position[2];
+    scene->planeSoA.nx[i] = plane->plane.normal[0];
+    scene->planeSoA.ny[i] = plane->plane.normal[1];
+    scene->planeSoA.nz[i] = plane->plane.normal[2];
+  }
+}
+
+// RenderStats counts work done by one render thread. Each thread keeps
+// its own counters and they are summed once the render finishes, so
+// counting costs a few increments of thread-local memory.
+typedef struct {
+  long primaryRays;
+  long shadowRays;
+  long sphereTests;
+  long planeTests;
+  long nodeVisits;
+  long shadowEarlyOuts; // shadow rays stopped by the first blocker found
+  long lightsSkipped; // lights skipped because the surface is outside a spot light's cone
+  long lightsCulled; // lights skipped because they are too far away to matter
+  long occluderCacheLookups;
+  long occluderCacheHits;
+  long packetCulls; // BVH nodes culled for a whole packet of rays
+} RenderStats;
+
+// closestHit returns the index of the nearest object along the ray, or
+// -1 if nothing is hit. Ties go to the object listed first in the scene
+// file, the same as a front-to-back scan of the object list.
+int closestHit(const Scene* scene, const real* Ro, const real* Rd, real* closestT, RenderStats* stats) {
+  int closest = -1;
+  *closestT = INFINITY;
+
+  real t[KERNEL_WIDTH];
+  stats->planeTests += scene->planeCount;
+  for (int first = 0; first < scene->planeCount; first += KERNEL_WIDTH) {
+    int count = scene->planeCount - first < KERNEL_WIDTH ? scene->planeCount - first : KERNEL_WIDTH;
+    scene->kernel->planes(&scene->planeSoA, first, count, Ro, Rd, t);
+    for (int i = 0; i < count; i++) {
+      int index = scene->planes[first + i];
+      if (t[i] > 0 && (t[i] < *closestT || (t[i] == *closestT && index < closest))) {
+        *closestT = t[i];
+        closest = index;
+      }
+    }
+  }
+
+  if (scene->nodeCount == 0) return closest;
+
+  int stack[BVH_MAX_DEPTH + 1];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BVHNode* node = &scene->nodes[stack[--top]];
+    stats->nodeVisits++;
+    real tNear, tFar;
+    if (!aabbRayInterval(&node->box, Ro, Rd, &tNear, &tFar)) continue;
+    if (tFar <= 0 || tNear > *closestT) continue;
+
+    if (node->count > 0) {
+      int end = node->offset + node->count;
+      stats->sphereTests += node->count;
+      for (int first = node->offset; first < end; first += KERNEL_WIDTH) {
+        int count = end - first < KERNEL_WIDTH ? end - first : KERNEL_WIDTH;
+        scene->kernel->spheres(&scene->sphereSoA, first, count, Ro, Rd, t);
+        for (int i = 0; i < count; i++) {
+          int index = scene->spheres[first + i];
+          if (t[i] > 0 && (t[i] < *closestT || (t[i] == *closestT && index < closest))) {
+            *closestT = t[i];
+            closest = index;
+          }
+        }
+      }
+    } else {
+      // Visit the nearer child first so the farther one can be culled
+      // by closestT. The left child holds the smaller centroids.
+      int left = node - scene->nodes + 1;
+      if (Rd[node->axis] >= 0) {
+        stack[top++] = node->offset;
+        stack[top++] = left;
+      } else {
+        stack[top++] = left;
+        stack[top++] = node->offset;
+      }
+    }
+  }
+  return closest;
+}
+
+// occluded returns the index of an object other than the one at index
+// ignore that the ray hits with 0 < t < maxT, or -1 if there is none.
+int occluded(const Scene* scene, const real* Ro, const real* Rd, real maxT, int ignore, RenderStats* stats) {
+  real t[KERNEL_WIDTH];
+  stats->planeTests += scene->planeCount;
+  for (int first = 0; first < scene->planeCount; first += KERNEL_WIDTH) {
+    int count = scene->planeCount - first < KERNEL_WIDTH ? scene->planeCount - first : KERNEL_WIDTH;
+    scene->kernel->planes(&scene->planeSoA, first, count, Ro, Rd, t);
+    for (int i = 0; i < count; i++) {
+      if (scene->planes[first + i] == ignore) continue;
+      if (t[i] > 0 && t[i] < maxT) return scene->planes[first + i];
+    }
+  }
+
+  if (scene->nodeCount == 0) return -1;
+
+  int stack[BVH_MAX_DEPTH + 1];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BVHNode* node = &scene->nodes[stack[--top]];
+    stats->nodeVisits++;
+    real tNear, tFar;
+    if (!aabbRayInterval(&node->box, Ro, Rd, &tNear, &tFar)) continue;
+    if (tFar <= 0 || tNear >= maxT) continue;
+
+    if (node->count > 0) {
+      int end = node->offset + node->count;
+      stats->sphereTests += node->count;
+      for (int first = node->offset; first < end; first += KERNEL_WIDTH) {
+        int count = end - first < KERNEL_WIDTH ? end - first : KERNEL_WIDTH;
+        scene->kernel->spheres(&scene->sphereSoA, first, count, Ro, Rd, t);
+        for (int i = 0; i < count; i++) {
+          if (scene->spheres[first + i] == ignore) continue;
+          if (t[i] > 0 && t[i] < maxT) return scene->spheres[first + i];
+        }
+      }
+    } else {
+      stack[top++] = node->offset;
+      stack[top++] = node - scene->nodes + 1;
+    }
+  }
+  return -1;
+}
+
+// Primary rays are traced in PACKET_SIZE x PACKET_SIZE packets that walk
+// the BVH together. PACKET_MARGIN widens a packet's bounds so that
+// rounding in the per-ray directions never culls a node one of its rays
+// would have entered.
+#define PACKET_SIZE 8
+#define PACKET_RAYS (PACKET_SIZE * PACKET_SIZE)
+#define PACKET_MARGIN 1e-3
+
+// A Frustum bounds a packet of rays leaving the origin: each direction
+// (x, y, z) has z > 0, u0 <= x/z <= u1 and v0 <= y/z <= v1.
+typedef struct {
+  real u0;
+  real u1;
+  real v0;
+  real v1;
+} Frustum;
+
+// frustumMisses returns 1 if box lies wholly outside one of the
+// frustum's planes, so no ray of the packet can enter it. Each side
+// plane is tested against the corner of the box furthest inside it.
+static inline int frustumMisses(const Frustum* f, const AABB* box) {
+  if (box->max[2] <= 0) return 1;
+  if (box->max[0] - f->u0 * (f->u0 > 0 ? box->min[2] : box->max[2]) < 0) return 1;
+  if (f->u1 * (f->u1 > 0 ? box->max[2] : box->min[2]) - box->min[0] < 0) return 1;
+  if (box->max[1] - f->v0 * (f->v0 > 0 ? box->min[2] : box->max[2]) < 0) return 1;
+  if (f->v1 * (f->v1 > 0 ? box->max[2] : box->min[2]) - box->min[1] < 0) return 1;
+  return 0;
+}
+
+// boxDistance2 returns the squared distance from the origin to box.
+static inline real boxDistance2(const AABB* box) {
+  real d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    if (box->min[i] > 0) {
+      d2 += box->min[i] * box->min[i];
+    } else if (box->max[i] < 0) {
+      d2 += box->max[i] * box->max[i];
+    }
+  }
+  return d2;
+}
+
+// closestHitPacket is closestHit() for count rays from the origin with
+// unit directions Rd inside frustum. The rays walk the BVH together,
+// each node carrying a mask of the rays that entered its parent. A node
+// is culled for the whole packet when it lies outside the frustum or
+// beyond every ray's closest hit so far, before any ray is clipped
+// against it. Rays are otherwise culled exactly as in closestHit(), so
+// each one gets the same hit.
+void closestHitPacket(const Scene* scene, const Frustum* frustum, int count, real (*Rd)[3], real* closestT, int* closest, RenderStats* stats) {
+  const real Ro[3] = {0, 0, 0};
+  real t[KERNEL_WIDTH];
+  real farthest = 0;
+  for (int r = 0; r < count; r++) {
+    closest[r] = -1;
+    closestT[r] = INFINITY;
+    stats->planeTests += scene->planeCount;
+    for (int first = 0; first < scene->planeCount; first += KERNEL_WIDTH) {
+      int n = scene->planeCount - first < KERNEL_WIDTH ? scene->planeCount - first : KERNEL_WIDTH;
+      scene->kernel->planes(&scene->planeSoA, first, n, Ro, Rd[r], t);
+      for (int i = 0; i < n; i++) {
+        int index = scene->planes[first + i];
+        if (t[i] > 0 && (t[i] < closestT[r] || (t[i] == closestT[r] && index < closest[r]))) {
+          closestT[r] = t[i];
+          closest[r] = index;
+        }
+      }
+    }
+    if (closestT[r] > farthest) farthest = closestT[r];
+  }
+
+  if (scene->nodeCount == 0) return;
+
+  // Children are visited nearer first along the packet's middle ray.
+  int positive[3] = {frustum->u0 + frustum->u1 >= 0, frustum->v0 + frustum->v1 >= 0, 1};
+  int stack[BVH_MAX_DEPTH + 1];
+  uint64_t masks[BVH_MAX_DEPTH + 1];
+  int top = 0;
+  stack[top] = 0;
+  masks[top++] = count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+  while (top > 0) {
+    top--;
+    const BVHNode* node = &scene->nodes[stack[top]];
+    stats->nodeVisits++;
+    if (frustumMisses(frustum, &node->box) ||
+        boxDistance2(&node->box) > sqr(farthest * (1 + PACKET_MARGIN))) {
+      stats->packetCulls++;
+      continue;
+    }
+
+    uint64_t active = 0;
+    for (uint64_t m = masks[top]; m != 0; m &= m - 1) {
+      int r = __builtin_ctzll(m);
+      real tNear, tFar;
+      if (aabbRayInterval(&node->box, Ro, Rd[r], &tNear, &tFar) && tFar > 0 && tNear <= closestT[r]) {
+        active |= (uint64_t)1 << r;
+      }
+    }
+    if (active == 0) continue;
+
+    if (node->count > 0) {
+      int end = node->offset + node->count;
+      for (uint64_t m = active; m != 0; m &= m - 1) {
+        int r = __builtin_ctzll(m);
+        stats->sphereTests += node->count;
+        for (int first = node->offset; first < end; first += KERNEL_WIDTH) {
+          int n = end - first < KERNEL_WIDTH ? end - first : KERNEL_WIDTH;
+          scene->kernel->spheres(&scene->sphereSoA, first, n, Ro, Rd[r], t);
+          for (int i = 0; i < n; i++) {
+            int index = scene->spheres[first + i];
+            if (t[i] > 0 && (t[i] < closestT[r] || (t[i] == closestT[r] && index < closest[r]))) {
+              closestT[r] = t[i];
+              closest[r] = index;
+            }
+          }
+        }
+      }
+      farthest = 0;
+      for (int r = 0; r < count; r++) {
+        if (closestT[r] > farthest) farthest = closestT[r];
+      }
+    } else {
+      int left = node - scene->nodes + 1;
+      int near = positive[node->axis] ? left : node->offset;
+      stack[top] = near == left ? node->offset : left;
+      masks[top++] = active;
+      stack[top] = near;
+      masks[top++] = active;
+    }
+  }
+}
+
+// TileBins lists, for each tile of a render, the spheres and planes its
+// primary rays can hit, found by projecting each sphere's bounding box
+// onto the image before rendering. Candidates are copied into their own
+// arrays grouped by tile, so the kernels can run over one tile's list.
+// Tiles that would list more than BIN_MAX_SPHERES spheres are left to
+// the BVH and have sphereFirst set to -1.
+#define BIN_MAX_SPHERES 256
+
+typedef struct {
+  Arena arena;
+  int* sphereFirst;
+  int* sphereCount;
+  int* planeFirst;
+  int* planeCount;
+  SphereSoA spheres;
+  int* sphereIndex; // object index of each listed sphere
+  PlaneSoA planes;
+  int* planeIndex;
+} TileBins;
+
+// closestHitBinned is closestHit() for count rays from the origin that
+// test only the candidates listed for tile. Ties are broken by object
+// index, so the order of the lists does not matter.
+void closestHitBinned(const Scene* scene, const TileBins* bins, int tile, int count, real (*Rd)[3], real* closestT, int* closest, RenderStats* stats) {
+  const real Ro[3] = {0, 0, 0};
+  real t[KERNEL_WIDTH];
+  int planeFirst = bins->planeFirst[tile];
+  int planeEnd = planeFirst + bins->planeCount[tile];
+  int sphereFirst = bins->sphereFirst[tile];
+  int sphereEnd = sphereFirst + bins->sphereCount[tile];
+  for (int r = 0; r < count; r++) {
+    closest[r] = -1;
+    closestT[r] = INFINITY;
+    stats->planeTests += planeEnd - planeFirst;
+    for (int first = planeFirst; first < planeEnd; first += KERNEL_WIDTH) {
+      int n = planeEnd - first < KERNEL_WIDTH ? planeEnd - first : KERNEL_WIDTH;
+      scene->kernel->planes(&bins->planes, first, n, Ro, Rd[r], t);
+      for (int i = 0; i < n; i++) {
+        int index = bins->planeIndex[first + i];
+        if (t[i] > 0 && (t[i] < closestT[r] || (t[i] == closestT[r] && index < closest[r]))) {
+          closestT[r] = t[i];
+          closest[r] = index;
+        }
+      }
+    }
+    stats->sphereTests += sphereEnd - sphereFirst;
+    for (int first = sphereFirst; first < sphereEnd; first += KERNEL_WIDTH) {
+      int n = sphereEnd - first < KERNEL_WIDTH ? sphereEnd - first : KERNEL_WIDTH;
+      scene->kernel->spheres(&bins->spheres, first, n, Ro, Rd[r], t);
+      for (int i = 0; i < n; i++) {
+        int index = bins->sphereIndex[first + i];
+        if (t[i] > 0 && (t[i] < closestT[r] || (t[i] == closestT[r] && index < closest[r]))) {
+          closestT[r] = t[i];
+          closest[r] = index;
+        }
+      }
+    }
+  }
+}
+
+// Lights are only put in a grid when at least this many have a finite
+// reach. The grid has at most LIGHT_GRID_MAX_CELLS cells and
+// LIGHT_GRID_MAX_ENTRIES light entries. Lights that reach more than
+// LIGHT_GRID_SPREAD times as far as the median light, or would cover
+// more than 1/LIGHT_GRID_WIDE of the grid, go in the global list
+// instead.
+#define LIGHT_GRID_MIN 16
+#define LIGHT_GRID_MAX_CELLS (1 << 18)
+#define LIGHT_GRID_MAX_ENTRIES (1 << 24)
+#define LIGHT_GRID_SPREAD 4
+#define LIGHT_GRID_WIDE 8
+
+int compareReals(const void* a, const void* b) {
+  real x = *(const real*)a;
+  real y = *(const real*)b;
+  return (x > y) - (x < y);
+}
+
+// lightReach returns a distance beyond which light adds less than cutoff
+// to every channel of a surface whose diffuse plus specular color is at
+// most reflectance, or INFINITY if the light has no such distance. The
+// reach is rounded up a little: lightReaches() makes the exact test.
+real lightReach(const PreparedLight* light, int spot, real reflectance, real cutoff) {
+  const real* a = light->radialAtten;
+  if (cutoff <= 0 || !light->radial || a[0] < 0 || a[1] < 0 || a[2] < 0) return INFINITY;
+  // Spot light falloff only stays at or below 1 inside a cone narrower
+  // than a half space and with a non-negative exponent.
+  if (spot && (light->cosHalfTheta <= 0 || light->angularAtten < 0)) return INFINITY;
+
+  real peak = 0;
+  for (int c = 0; c < 3; c++) {
+    if (fabs(light->color[c]) > peak) peak = fabs(light->color[c]);
+  }
+  // The light is below the cutoff wherever a2 d^2 + a1 d + a0 > limit.
+  double limit = (double)peak * reflectance / cutoff;
+  double d;
+  if (a[0] > limit) {
+    d = 0;
+  } else if (a[2] > 0) {
+    d = (-a[1] + sqrt((double)a[1] * a[1] + 4.0 * a[2] * (limit - a[0]))) / (2.0 * a[2]);
+  } else if (a[1] > 0) {
+    d = (limit - a[0]) / a[1];
+  } else {
+    return INFINITY;
+  }
+  return (real)(d * 1.001 + 1e-3);
+}
+
+// listAllLights replaces the scene's light grid with a global list of
+// every light.
+void listAllLights(Scene* scene) {
+  LightGrid* grid = &scene->lightGrid;
+  int lightCount = scene->pointLightCount + scene->spotLightCount;
+  freeLightGrid(grid);
+  grid->global = malloc(sizeof(int) * (lightCount + 1));
+  if (grid->global == NULL) {
+    outOfMemory(scene->arena.failure);
+  }
+  for (int i = 0; i < lightCount; i++) {
+    grid->global[i] = i;
+  }
+  grid->globalCount = lightCount;
+}
+
+// buildLightGrid indexes the scene's prepared lights by where they can
+// reach, replacing any previous grid. The grid only saves work, so if
+// there is no memory for it every light stays global.
+void buildLightGrid(Scene* scene) {
+  LightGrid* grid = &scene->lightGrid;
+  int lightCount = scene->pointLightCount + scene->spotLightCount;
+  listAllLights(scene);
+
+  real* reaches = malloc(sizeof(real) * (lightCount + 1));
+  if (reaches == NULL) return;
+  int finite = 0;
+  for (int i = 0; i < lightCount; i++) {
+    if (scene->preparedLights[i].reach < INFINITY) {
+      reaches[finite++] = scene->preparedLights[i].reach;
+    }
+  }
+  real maxReach = 0;
+  if (finite > 0) {
+    qsort(reaches, finite, sizeof(real), compareReals);
+    maxReach = LIGHT_GRID_SPREAD * reaches[finite / 2];
+  }
+  free(reaches);
+
+  int bounded = 0;
+  AABB bounds;
+  aabbEmpty(&bounds);
+  for (int i = 0; i < lightCount; i++) {
+    const PreparedLight* light = &scene->preparedLights[i];
+    if (light->reach > maxReach) continue;
+    bounded++;
+    for (int k = 0; k < 3; k++) {
+      if (light->position[k] - light->reach < bounds.min[k]) bounds.min[k] = light->position[k] - light->reach;
+      if (light->position[k] + light->reach > bounds.max[k]) bounds.max[k] = light->position[k] + light->reach;
+    }
+  }
+
+  // Aim for a few cells per light, fewer if that would be too many.
+  real extent[3];
+  real volume = 1;
+  for (int k = 0; k < 3; k++) {
+    extent[k] = bounds.max[k] - bounds.min[k];
+    volume *= extent[k] > 0 ? extent[k] : 1;
+  }
+  long target = 4L * bounded < LIGHT_GRID_MAX_CELLS ? 4L * bounded : LIGHT_GRID_MAX_CELLS;
+  real cell = cbrt(volume / target);
+  long cells = 0;
+  while (bounded >= LIGHT_GRID_MIN && isfinite(cell) && cell > 0) {
+    cells = 1;
+    for (int k = 0; k < 3; k++) {
+      grid->dims[k] = (int)ceil(extent[k] / cell);
+      if (grid->dims[k] < 1) grid->dims[k] = 1;
+      cells *= grid->dims[k];
+    }
+    if (cells <= LIGHT_GRID_MAX_CELLS) break;
+    cell *= 1.25;
+  }
+
+  // Without a usable grid every light stays global.
+  if (cells == 0 || cells > LIGHT_GRID_MAX_CELLS) return;
+  grid->globalCount = 0;
+  grid->bounds = bounds;
+  grid->inverseCell = 1 / cell;
+
+  // Count each cell's lights, then fill the cells in light order.
+  int* range = malloc(sizeof(int) * 6 * (lightCount + 1));
+  grid->cellFirst = calloc(cells + 1, sizeof(int));
+  if (range == NULL || grid->cellFirst == NULL) {
+    free(range);
+    listAllLights(scene);
+    return;
+  }
+  long entries = 0;
+  for (int i = 0; i < lightCount; i++) {
+    const PreparedLight* light = &scene->preparedLights[i];
+    int* r = &range[6 * i];
+    long covered = 1;
+    if (light->reach <= maxReach) {
+      for (int k = 0; k < 3; k++) {
+        r[k] = (int)((light->position[k] - light->reach - bounds.min[k]) * grid->inverseCell);
+        r[k + 3] = (int)((light->position[k] + light->reach - bounds.min[k]) * grid->inverseCell);
+        if (r[k] < 0) r[k] = 0;
+        if (r[k + 3] > grid->dims[k] - 1) r[k + 3] = grid->dims[k] - 1;
+        covered *= r[k + 3] - r[k] + 1;
+      }
+    }
+    if (light->reach > maxReach || covered * LIGHT_GRID_WIDE > cells) {
+      grid->global[grid->globalCount++] = i;
+      r[0] = -1;
+      continue;
+    }
+    entries += covered;
+    for (int z = r[2]; z <= r[5]; z++) {
+      for (int y = r[1]; y <= r[4]; y++) {
+        for (int x = r[0]; x <= r[3]; x++) {
+          grid->cellFirst[(z * grid->dims[1] + y) * grid->dims[0] + x + 1]++;
+        }
+      }
+    }
+  }
+  if (entries > LIGHT_GRID_MAX_ENTRIES) {
+    free(range);
+    listAllLights(scene);
+    return;
+  }
+
+  for (long c = 0; c < cells; c++) {
+    grid->cellFirst[c + 1] += grid->cellFirst[c];
+  }
+  grid->cellLights = malloc(sizeof(int) * (entries + 1));
+  int* fill = malloc(sizeof(int) * cells);
+  if (grid->cellLights == NULL || fill == NULL) {
+    free(fill);
+    free(range);
+    listAllLights(scene);
+    return;
+  }
+  memcpy(fill, grid->cellFirst, sizeof(int) * cells);
+  for (int i = 0; i < lightCount; i++) {
+    const int* r = &range[6 * i];
+    if (r[0] < 0) continue;
+    for (int z = r[2]; z <= r[5]; z++) {
+      for (int y = r[1]; y <= r[4]; y++) {
+        for (int x = r[0]; x <= r[3]; x++) {
+          grid->cellLights[fill[(z * grid->dims[1] + y) * grid->dims[0] + x]++] = i;
+        }
+      }
+    }
+  }
+  free(fill);
+  free(range);
+}
+
+// prepareLights sorts the scene's lights into point lights followed by
+// spot lights, keeping file order within each group, works out which
+// attenuation terms each one actually uses and how far it reaches, and
+// indexes them in the scene's light grid. Calling it again after the
+// lights or materials change reuses the same array.
+void prepareLights(Scene* scene) {
+  if (scene->preparedLights == NULL) {
+    scene->preparedLights = arenaAlloc(&scene->arena, sizeof(PreparedLight) * (scene->lightCount + 1));
+  }
+  scene->pointLightCount = 0;
+  scene->spotLightCount = 0;
+
+  // How much of a light any surface in the scene can reflect.
+  real reflectance = 0;
+  for (int i = 0; i < scene->materialCount; i++) {
+    const Material* material = &scene->materials[i];
+    for (int c = 0; c < 3; c++) {
+      real r = fabs(material->diffuseColor[c]) + fabs(material->specularColor[c]);
+      if (r > reflectance) reflectance = r;
+    }
+  }
+
+  for (int spot = 0; spot < 2; spot++) {
+    for (int i = 0; i < scene->lightCount; i++) {
+      const Light* light = &scene->lights[i];
+      int isSpot = light->angularAtten != INFINITY && light->theta != 0;
+      if (isSpot != spot) continue;
+
+      PreparedLight* prepared = &scene->preparedLights[scene->pointLightCount + scene->spotLightCount];
+      for (int j = 0; j < 3; j++) {
+        prepared->color[j] = light->color[j];
+        prepared->position[j] = light->position[j];
+        prepared->direction[j] = light->direction[j];
+        prepared->radialAtten[j] = light->radialAtten[j];
+      }
+      prepared->angularAtten = light->angularAtten;
+      // A surface is outside the cone where acos(dot) > halfTheta. The
+      // shaders test dot < cosHalfTheta instead, and leave rounded dot
+      // products outside [-1, 1], whose acos() is NaN, lit. A negative
+      // cone holds nothing else and one past pi holds everything. In
+      // between, cos() may round either way, so the bound is moved to
+      // the smallest dot product that acos() puts inside the cone.
+      real halfTheta = degreesToRads(light->theta) / 2;
+      if (halfTheta < 0) {
+        prepared->cosHalfTheta = nextafter((real)1, (real)2);
+      } else if (halfTheta >= acos((real)-1)) {
+        prepared->cosHalfTheta = -INFINITY;
+      } else {
+        real bound = cos(halfTheta);
+        while (bound < 1 && acos(bound) > halfTheta) {
+          bound = nextafter(bound, (real)2);
+        }
+        while (bound > -1 && !(acos(nextafter(bound, (real)-2)) > halfTheta)) {
+          bound = nextafter(bound, (real)-2);
+        }
+        prepared->cosHalfTheta = bound;
+      }
+      prepared->radial = light->radialAtten[0] != INFINITY;
+      prepared->reach = lightReach(prepared, isSpot, reflectance, scene->lightCutoff);
+      if (isSpot) {
+        scene->spotLightCount++;
+      } else {
+        scene->pointLightCount++;
+      }
+    }
+  }
+  buildLightGrid(scene);
+}
+
+// A compiled scene cache (.rsc) holds a parsed scene and its acceleration
+// structure exactly as they are laid out in memory, so loading one only
+// maps the file and points the scene into it. The layout depends on this
+// build's structures: bump RSC_VERSION whenever Object, Light, BVHNode or
+// the section list changes. Caches are native-endian.
+#define RSC_MAGIC "RAYSCN\r\n"
+#define RSC_VERSION 2
+#define RSC_ALIGN 32
+
+enum {
+  RSC_CAMERA,
+  RSC_OBJECTS,
+  RSC_MATERIALS,
+  RSC_LIGHTS,
+  RSC_PLANES,
+  RSC_SPHERES,
+  RSC_NODES,
+  RSC_SPHERE_X,
+  RSC_SPHERE_Y,
+  RSC_SPHERE_Z,
+  RSC_SPHERE_R2,
+  RSC_PLANE_PX,
+  RSC_PLANE_PY,
+  RSC_PLANE_PZ,
+  RSC_PLANE_NX,
+  RSC_PLANE_NY,
+  RSC_PLANE_NZ,
+  RSC_SECTIONS
+};
+
+typedef struct {
+  char magic[8];
+  uint64_t version;
+  uint64_t objectSize;
+  uint64_t lightSize;
+  uint64_t nodeSize;
+  uint64_t objectCount;
+  uint64_t materialCount;
+  uint64_t lightCount;
+  uint64_t planeCount;
+  uint64_t sphereCount;
+  uint64_t nodeCount;
+  uint64_t offsets[RSC_SECTIONS];
+  uint64_t sizes[RSC_SECTIONS];
+  uint64_t fileSize;
+  uint64_t checksum; // of everything after the header
+
+  // The JSON file the cache was compiled from. A cache is stale, and is
+  // rejected, if that file still exists but has changed since.
+  uint64_t sourceSize;
+  int64_t sourceMtime;
+  int64_t sourceMtimeNsec;
+  char source[1024];
+} SceneCacheHeader;
+
+static inline size_t alignUp(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+// cacheChecksum mixes size bytes of data, a multiple of 8, into hash.
+uint64_t cacheChecksum(uint64_t hash, const void* data, size_t size) {
+  const unsigned char* p = data;
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+// sceneSections lists the start and size of each section of the cache
+// for the scene's current contents.
+void sceneSections(const Scene* scene, const void** data, size_t* sizes) {
+  size_t sphereLanes = sizeof(real) * ((scene->sphereCount + KERNEL_WIDTH - 1) / KERNEL_WIDTH * KERNEL_WIDTH + KERNEL_WIDTH);
+  size_t planeLanes = sizeof(real) * ((scene->planeCount + KERNEL_WIDTH - 1) / KERNEL_WIDTH * KERNEL_WIDTH + KERNEL_WIDTH);
+  const void* sectionData[RSC_SECTIONS] = {
+    scene->camera, scene->objects, scene->materials, scene->lights, scene->planes, scene->spheres, scene->nodes,
+    scene->sphereSoA.x, scene->sphereSoA.y, scene->sphereSoA.z, scene->sphereSoA.r2,
+    scene->planeSoA.px, scene->planeSoA.py, scene->planeSoA.pz,
+    scene->planeSoA.nx, scene->planeSoA.ny, scene->planeSoA.nz
+  };
+  size_t sectionSizes[RSC_SECTIONS] = {
+    sizeof(Camera), sizeof(Object) * scene->objectCount, sizeof(Material) * scene->materialCount, sizeof(Light) * scene->lightCount,
+    sizeof(int) * scene->planeCount, sizeof(int) * scene->sphereCount, sizeof(BVHNode) * scene->nodeCount,
+    sphereLanes, sphereLanes, sphereLanes, sphereLanes,
+    planeLanes, planeLanes, planeLanes, planeLanes, planeLanes, planeLanes
+  };
+  memcpy(data, sectionData, sizeof(sectionData));
+  memcpy(sizes, sectionSizes, sizeof(sectionSizes));
+}
+
+// compileScene parses the JSON scene at sourcePath, builds its
+// acceleration structure and writes both to a cache at cachePath.
+void compileScene(char* sourcePath, const char* cachePath) {
+  Scene scene;
+  initScene(&scene);
+  parseJSON(sourcePath, &scene);
+  buildBVH(&scene);
+
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RSC_MAGIC, 8);
+  header.version = RSC_VERSION;
+  header.objectSize = sizeof(Object);
+  header.lightSize = sizeof(Light);
+  header.nodeSize = sizeof(BVHNode);
+  header.objectCount = scene.objectCount;
+  header.materialCount = scene.materialCount;
+  header.lightCount = scene.lightCount;
+  header.planeCount = scene.planeCount;
+  header.sphereCount = scene.sphereCount;
+  header.nodeCount = scene.nodeCount;
+
+  struct stat st;
+  char* source = realpath(sourcePath, NULL);
+  if (source != NULL && strlen(source) < sizeof(header.source) && stat(source, &st) == 0 && S_ISREG(st.st_mode)) {
+    strcpy(header.source, source);
+    header.sourceSize = st.st_size;
+    header.sourceMtime = st.st_mtim.tv_sec;
+    header.sourceMtimeNsec = st.st_mtim.tv_nsec;
+  }
+  free(source);
+
+  const void* data[RSC_SECTIONS];
+  size_t offset = alignUp(sizeof(header), RSC_ALIGN);
+  sceneSections(&scene, data, header.sizes);
+  uint64_t checksum = 0xcbf29ce484222325ULL;
+  static const char zeros[RSC_ALIGN];
+  for (int i = 0; i < RSC_SECTIONS; i++) {
+    header.offsets[i] = offset;
+    offset += alignUp(header.sizes[i], RSC_ALIGN);
+  }
+  header.fileSize = offset;
+
+  FILE* fh = fopen(cachePath, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", cachePath);
+    exit(1);
+  }
+  // The checksum is only known once every section has been written, so
+  // the header is written twice.
+  fwrite(&header, sizeof(header), 1, fh);
+  fwrite(zeros, alignUp(sizeof(header), RSC_ALIGN) - sizeof(header), 1, fh);
+  for (int i = 0; i < RSC_SECTIONS; i++) {
+    size_t whole = header.sizes[i] / 8 * 8;
+    fwrite(data[i], header.sizes[i], 1, fh);
+    checksum = cacheChecksum(checksum, data[i], whole);
+
+    unsigned char tail[RSC_ALIGN];
+    size_t padded = alignUp(header.sizes[i], RSC_ALIGN) - whole;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, (const char*)data[i] + whole, header.sizes[i] - whole);
+    fwrite(zeros, padded - (header.sizes[i] - whole), 1, fh);
+    checksum = cacheChecksum(checksum, tail, padded);
+  }
+  header.checksum = checksum;
+  if (fseek(fh, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fh) != 1 || fclose(fh) != 0) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", cachePath);
+    exit(1);
+  }
+  freeScene(&scene);
+}
+
+// SceneError is what readScene() reports. It has the fields of
+// RaycastError, with room in message for a file path and the source
+// path stored in a scene cache.
+typedef struct {
+  RaycastStatus status;
+  int line;
+  char message[PATH_MAX + sizeof(((SceneCacheHeader*)0)->source) + 128];
+} SceneError;
+
+// cacheError fills in error for the scene cache at path and returns
+// its status.
+RaycastStatus cacheError(SceneError* error, const char* path, const char* message) {
+  error->status = RAYCAST_ERROR_PARSE;
+  error->line = 0;
+  snprintf(error->message, sizeof(error->message), "Scene cache \"%s\" %s.", path, message);
+  return error->status;
+}
+
+// loadSceneCache points scene at the objects, lights, camera and
+// acceleration structure stored in the cache mapped at file. The scene
+// takes ownership of the mapping. Caches from another build, damaged
+// caches and caches older than their source file are rejected with an
+// error, and the mapping is left to the caller.
+RaycastStatus loadSceneCache(const char* path, MappedFile* file, Scene* scene, SceneError* error) {
+  SceneCacheHeader header;
+  memcpy(&header, file->data, sizeof(header));
+  if (header.version != RSC_VERSION || header.objectSize != sizeof(Object) ||
+      header.lightSize != sizeof(Light) || header.nodeSize != sizeof(BVHNode)) {
+    return cacheError(error, path, "was written by a different version of raycast; recompile it");
+  }
+  if (header.fileSize != file->size || header.objectCount > INT_MAX || header.materialCount > header.objectCount ||
+      header.lightCount > INT_MAX ||
+      header.planeCount + header.sphereCount != header.objectCount || header.nodeCount > 2 * header.sphereCount + 1) {
+    return cacheError(error, path, "is damaged");
+  }
+
+  scene->objectCount = header.objectCount;
+  scene->materialCount = header.materialCount;
+  scene->lightCount = header.lightCount;
+  scene->planeCount = header.planeCount;
+  scene->sphereCount = header.sphereCount;
+  scene->nodeCount = header.nodeCount;
+  const void* unused[RSC_SECTIONS];
+  size_t sizes[RSC_SECTIONS];
+  sceneSections(scene, unused, sizes);
+  size_t start = alignUp(sizeof(header), RSC_ALIGN);
+  for (int i = 0; i < RSC_SECTIONS; i++) {
+    if (header.sizes[i] != sizes[i] || header.offsets[i] != start) {
+      return cacheError(error, path, "is damaged");
+    }
+    start += alignUp(sizes[i], RSC_ALIGN);
+  }
+  if (start != file->size) {
+    return cacheError(error, path, "is damaged");
+  }
+  size_t payload = alignUp(sizeof(header), RSC_ALIGN);
+  if (cacheChecksum(0xcbf29ce484222325ULL, file->data + payload, file->size - payload) != header.checksum) {
+    return cacheError(error, path, "is damaged (checksum mismatch)");
+  }
+
+  struct stat st;
+  if (header.source[0] != '\0' && memchr(header.source, '\0', sizeof(header.source)) != NULL &&
+      stat(header.source, &st) == 0 &&
+      ((uint64_t)st.st_size != header.sourceSize || st.st_mtim.tv_sec != header.sourceMtime ||
+       st.st_mtim.tv_nsec != header.sourceMtimeNsec)) {
+    char message[sizeof(header.source) + 64];
+    snprintf(message, sizeof(message), "is out of date; recompile it from \"%s\"", header.source);
+    return cacheError(error, path, message);
+  }
+
+  char* base = file->data;
+  scene->camera = (Camera*)(base + header.offsets[RSC_CAMERA]);
+  scene->objects = (Object*)(base + header.offsets[RSC_OBJECTS]);
+  scene->objectCapacity = scene->objectCount;
+  scene->materials = (Material*)(base + header.offsets[RSC_MATERIALS]);
+  scene->materialCapacity = scene->materialCount;
+  scene->lights = (Light*)(base + header.offsets[RSC_LIGHTS]);
+  scene->lightCapacity = scene->lightCount;
+  scene->planes = (int*)(base + header.offsets[RSC_PLANES]);
+  scene->spheres = (int*)(base + header.offsets[RSC_SPHERES]);
+  scene->nodes = (BVHNode*)(base + header.offsets[RSC_NODES]);
+  scene->sphereSoA.x = (real*)(base + header.offsets[RSC_SPHERE_X]);
+  scene->sphereSoA.y = (real*)(base + header.offsets[RSC_SPHERE_Y]);
+  scene->sphereSoA.z = (real*)(base + header.offsets[RSC_SPHERE_Z]);
+  scene->sphereSoA.r2 = (real*)(base + header.offsets[RSC_SPHERE_R2]);
+  scene->planeSoA.px = (real*)(base + header.offsets[RSC_PLANE_PX]);
+  scene->planeSoA.py = (real*)(base + header.offsets[RSC_PLANE_PY]);
+  scene->planeSoA.pz = (real*)(base + header.offsets[RSC_PLANE_PZ]);
+  scene->planeSoA.nx = (real*)(base + header.offsets[RSC_PLANE_NX]);
+  scene->planeSoA.ny = (real*)(base + header.offsets[RSC_PLANE_NY]);
+  scene->planeSoA.nz = (real*)(base + header.offsets[RSC_PLANE_NZ]);
+  scene->cache = *file;
+  return RAYCAST_OK;
+}
+
+// readScene reads the scene at path, which may be JSON or a compiled
+// scene cache. *cached is set to 1 if the acceleration structure came
+// from a cache and 0 if it still has to be built. On failure the scene
+// still has to be freed.
+RaycastStatus readScene(const char* path, Scene* scene, int* cached, SceneError* error) {
+  *cached = 0;
+  MappedFile file;
+  if (!mapFile(path, &file)) {
+    error->status = RAYCAST_ERROR_ARGUMENT;
+    error->line = 0;
+    snprintf(error->message, sizeof(error->message), "Could not open file \"%s\"", path);
+    return error->status;
+  }
+
+  if (file.size >= sizeof(SceneCacheHeader) && memcmp(file.data, RSC_MAGIC, 8) == 0) {
+    if (loadSceneCache(path, &file, scene, error) != RAYCAST_OK) {
+      unmapFile(&file);
+      return error->status;
+    }
+    *cached = 1;
+    return RAYCAST_OK;
+  }
+
+  RaycastError parseFailure;
+  parseSceneThreads(file.data, file.size, scene, &parseFailure, scene->parseThreads);
+  unmapFile(&file);
+  error->status = parseFailure.status;
+  error->line = parseFailure.line;
+  strcpy(error->message, parseFailure.message);
+  return error->status;
+}
+
+// loadScene reads the scene at path like readScene(), exiting with its
+// message if it cannot. Returns 1 if the acceleration structure came
+// from a cache and 0 if it still has to be built.
+int loadScene(char* path, Scene* scene) {
+  int cached;
+  SceneError error;
+  if (readScene(path, scene, &cached, &error) != RAYCAST_OK) {
+    fprintf(stderr, "Error: %s\n", error.message);
+    exit(1);
+  }
+  return cached;
+}
+
+// View holds the camera math shared by every pixel of a render.
+typedef struct {
+  int M;
+  int N;
+  real cx;
+  real cy;
+  real w;
+  real h;
+  real pixwidth;
+  real pixheight;
+} View;
+
+void setupView(View* view, const Scene* scene, int width, int height) {
+  view->M = height;
+  view->N = width;
+  view->cx = 0;
+  view->cy = 0;
+  view->w = scene->camera->width;
+  view->h = scene->camera->height;
+  view->pixheight = view->h / view->M;
+  view->pixwidth = view->w / view->N;
+}
+
+// RenderState is the per-thread scratch space used by renderPixel().
+typedef struct {
+  int* lastOccluder; // per light, the object that last blocked it or -1
+  uint64_t* lightBits; // per light, one bit, all clear between packets
+  RenderStats stats;
+} RenderState;
+
+void addStats(RenderStats* total, const RenderStats* stats) {
+  total->primaryRays += stats->primaryRays;
+  total->shadowRays += stats->shadowRays;
+  total->sphereTests += stats->sphereTests;
+  total->planeTests += stats->planeTests;
+  total->nodeVisits += stats->nodeVisits;
+  total->shadowEarlyOuts += stats->shadowEarlyOuts;
+  total->lightsSkipped += stats->lightsSkipped;
+  total->lightsCulled += stats->lightsCulled;
+  total->occluderCacheLookups += stats->occluderCacheLookups;
+  total->occluderCacheHits += stats->occluderCacheHits;
+  total->packetCulls += stats->packetCulls;
+}
+
+real objectIntersection(const Object* object, const real* Ro, const real* Rd) {
+  if (object->kind == PLANE) {
+    return planeIntersection(Ro, Rd, object->position, object->plane.normal);
+  }
+  return sphereIntersection(Ro, Rd, object->position, object->sphere.radius);
+}
+
+// cachedOccluder reports whether the object that blocked light last
+// time also blocks this shadow ray. Neighbouring pixels are nearly
+// always blocked by the same object, so it is tested before a full
+// occluded() query.
+static inline int cachedOccluder(const Scene* scene, RenderState* state, int light, const real* Ro, const real* Rd, real maxT, int ignore) {
+  int cached = state->lastOccluder[light];
+  if (cached < 0 || cached == ignore) return 0;
+  state->stats.occluderCacheLookups++;
+  if (scene->objects[cached].kind == PLANE) {
+    state->stats.planeTests++;
+  } else {
+    state->stats.sphereTests++;
+  }
+  real t = objectIntersection(&scene->objects[cached], Ro, Rd);
+  if (t > 0 && t < maxT) {
+    state->stats.occluderCacheHits++;
+    state->stats.shadowEarlyOuts++;
+    return 1;
+  }
+  return 0;
+}
+
+// shadowed reports whether the shadow ray toward light is blocked.
+int shadowed(const Scene* scene, RenderState* state, int light, const real* Ro, const real* Rd, real maxT, int ignore) {
+  state->stats.shadowRays++;
+  if (cachedOccluder(scene, state, light, Ro, Rd, maxT, ignore)) return 1;
+
+  int blocker = occluded(scene, Ro, Rd, maxT, ignore, &state->stats);
+  if (blocker < 0) return 0;
+  state->stats.shadowEarlyOuts++;
+  state->lastOccluder[light] = blocker;
+  return 1;
+}
+
+// shadowPacket is shadowed() for count shadow rays toward the same
+// light, setting blocked[r] for each one. The rays walk the BVH together
+// as in closestHitPacket(), and a node is culled for all of them at once
+// when it misses the box around every ray's segment from Ro to
+// Ro + maxT * Rd. Rays drop out of the walk as soon as a blocker is found.
+void shadowPacket(const Scene* scene, RenderState* state, int light, int count, real (*Ro)[3], real (*Rd)[3], const real* maxT, const int* ignore, unsigned char* blocked) {
+  real t[KERNEL_WIDTH];
+  uint64_t pending = 0;
+  for (int r = 0; r < count; r++) {
+    state->stats.shadowRays++;
+    blocked[r] = cachedOccluder(scene, state, light, Ro[r], Rd[r], maxT[r], ignore[r]);
+    if (blocked[r]) continue;
+
+    state->stats.planeTests += scene->planeCount;
+    for (int first = 0; first < scene->planeCount && !blocked[r]; first += KERNEL_WIDTH) {
+      int n = scene->planeCount - first < KERNEL_WIDTH ? scene->planeCount - first : KERNEL_WIDTH;
+      scene->kernel->planes(&scene->planeSoA, first, n, Ro[r], Rd[r], t);
+      for (int i = 0; i < n; i++) {
+        if (scene->planes[first + i] == ignore[r]) continue;
+        if (t[i] > 0 && t[i] < maxT[r]) {
+          blocked[r] = 1;
+          state->stats.shadowEarlyOuts++;
+          state->lastOccluder[light] = scene->planes[first + i];
+          break;
+        }
+      }
+    }
+    if (!blocked[r]) pending |= (uint64_t)1 << r;
+  }
+
+  if (scene->nodeCount == 0 || pending == 0) return;
+
+  AABB bounds;
+  aabbEmpty(&bounds);
+  for (uint64_t m = pending; m != 0; m &= m - 1) {
+    int r = __builtin_ctzll(m);
+    real end[3] = {
+      Ro[r][0] + maxT[r] * Rd[r][0],
+      Ro[r][1] + maxT[r] * Rd[r][1],
+      Ro[r][2] + maxT[r] * Rd[r][2]
+    };
+    aabbGrowPoint(&bounds, Ro[r]);
+    aabbGrowPoint(&bounds, end);
+  }
+  for (int i = 0; i < 3; i++) {
+    real pad = PACKET_MARGIN * (fabs(bounds.min[i]) + fabs(bounds.max[i]) + 1);
+    bounds.min[i] -= pad;
+    bounds.max[i] += pad;
+  }
+
+  int stack[BVH_MAX_DEPTH + 1];
+  uint64_t masks[BVH_MAX_DEPTH + 1];
+  int top = 0;
+  stack[top] = 0;
+  masks[top++] = pending;
+  while (top > 0 && pending != 0) {
+    top--;
+    const BVHNode* node = &scene->nodes[stack[top]];
+    state->stats.nodeVisits++;
+    int outside = 0;
+    for (int i = 0; i < 3; i++) {
+      outside |= node->box.min[i] > bounds.max[i] || node->box.max[i] < bounds.min[i];
+    }
+    if (outside) {
+      state->stats.packetCulls++;
+      continue;
+    }
+
+    uint64_t active = 0;
+    for (uint64_t m = masks[top] & pending; m != 0; m &= m - 1) {
+      int r = __builtin_ctzll(m);
+      real tNear, tFar;
+      if (aabbRayInterval(&node->box, Ro[r], Rd[r], &tNear, &tFar) && tFar > 0 && tNear < maxT[r]) {
+        active |= (uint64_t)1 << r;
+      }
+    }
+    if (active == 0) continue;
+
+    if (node->count == 0) {
+      stack[top] = node->offset;
+      masks[top++] = active;
+      stack[top] = node - scene->nodes + 1;
+      masks[top++] = active;
+      continue;
+    }
+
+    int end = node->offset + node->count;
+    for (uint64_t m = active; m != 0; m &= m - 1) {
+      int r = __builtin_ctzll(m);
+      state->stats.sphereTests += node->count;
+      for (int first = node->offset; first < end && !blocked[r]; first += KERNEL_WIDTH) {
+        int n = end - first < KERNEL_WIDTH ? end - first : KERNEL_WIDTH;
+        scene->kernel->spheres(&scene->sphereSoA, first, n, Ro[r], Rd[r], t);
+        for (int i = 0; i < n; i++) {
+          if (scene->spheres[first + i] == ignore[r]) continue;
+          if (t[i] > 0 && t[i] < maxT[r]) {
+            blocked[r] = 1;
+            state->stats.shadowEarlyOuts++;
+            state->lastOccluder[light] = scene->spheres[first + i];
+            pending &= ~((uint64_t)1 << r);
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Surface holds the terms of a hit point that every light shares.
+typedef struct {
+  real position[3];
+  real N[3];
+  real V[3];
+  const real* diffuseColor;
+  const real* specularColor;
+} Surface;
+
+// shadeLight adds one unshadowed light's contribution at the surface to
+// color. The geometry terms are computed once and applied to all three
+// channels. Returns 0 if the surface is outside a spot light's cone.
+static inline int shadeLight(const PreparedLight* light, const Surface* surface, const real* RdNew, int spot, real* color) {
+  real L[3] = {
+    RdNew[0],
+    RdNew[1],
+    RdNew[2]
+  };
+  normalize(L);
+
+  real atten = 1;
+  if (spot) {
+    real LNeg[3] = {
+      -L[0],
+      -L[1],
+      -L[2]
+    };
+    real dotResult = dot(LNeg, light->direction);
+    if (dotResult < light->cosHalfTheta && dotResult >= -1) return 0;
+    atten = pow(dotResult, light->angularAtten);
+  }
+  if (light->radial) {
+    real pos[3] = {
+      light->position[0],
+      light->position[1],
+      light->position[2]
+    };
+    subtract(pos, surface->position);
+    real d = magnitude(pos);
+    atten *= radialAttenuation(light->radialAtten[2], light->radialAtten[1], light->radialAtten[0], d);
+  }
+
+  real R[3];
+  reflect(L, surface->N, R);
+  real diffuse = dot(surface->N, L);
+  real specular = dot(surface->V, R);
+  int lit = diffuse > 0;
+  int shiny = lit && specular > 0;
+  if (shiny) {
+    specular = pow(specular, (real)SPECULAR_EXPONENT);
+  }
+
+  for (int c = 0; c < 3; c++) {
+    real d = lit ? surface->diffuseColor[c] * light->color[c] * diffuse : 0;
+    real s = shiny ? surface->specularColor[c] * light->color[c] * specular : 0;
+    color[c] += atten * (d + s);
+  }
+  return 1;
+}
+
+// initSurface fills in the hit point at closestT along the ray and the
+// normal, view direction and colors of the object hit there, which has
+// the given material.
+static inline void initSurface(Surface* surface, const Object* object, const Material* material, real closestT, const real* Ro, const real* Rd) {
+  surface->position[0] = closestT * Rd[0] + Ro[0];
+  surface->position[1] = closestT * Rd[1] + Ro[1];
+  surface->position[2] = closestT * Rd[2] + Ro[2];
+  if (object->kind == PLANE) {
+    surface->N[0] = object->plane.normal[0];
+    surface->N[1] = object->plane.normal[1];
+    surface->N[2] = object->plane.normal[2];
+  } else {
+    surface->N[0] = surface->position[0] - object->position[0];
+    surface->N[1] = surface->position[1] - object->position[1];
+    surface->N[2] = surface->position[2] - object->position[2];
+  }
+  normalize(surface->N);
+  surface->V[0] = Rd[0];
+  surface->V[1] = Rd[1];
+  surface->V[2] = Rd[2];
+  surface->diffuseColor = material->diffuseColor;
+  surface->specularColor = material->specularColor;
+}
+
+// lightDirection sets RdNew to the normalized direction from the surface
+// toward light.
+static inline void lightDirection(const PreparedLight* light, const Surface* surface, real* RdNew) {
+  RdNew[0] = light->position[0] - surface->position[0];
+  RdNew[1] = light->position[1] - surface->position[1];
+  RdNew[2] = light->position[2] - surface->position[2];
+  normalize(RdNew);
+}
+
+// lightReaches reports whether light i can add to the color of the
+// surface, using the tests that are cheaper than a shadow ray: the
+// surface must be inside a spot light's cone, and close enough for the
+// light to add at least the scene's cutoff to some channel.
+static inline int lightReaches(const Scene* scene, RenderState* state, int i, const Surface* surface, const real* RdNew) {
+  const PreparedLight* light = &scene->preparedLights[i];
+  if (light->reach < INFINITY) {
+    real pos[3] = {
+      light->position[0],
+      light->position[1],
+      light->position[2]
+    };
+    subtract(pos, surface->position);
+    real atten = radialAttenuation(light->radialAtten[2], light->radialAtten[1], light->radialAtten[0], magnitude(pos));
+    real peak = 0;
+    for (int c = 0; c < 3; c++) {
+      real p = fabs(light->color[c]) * (fabs(surface->diffuseColor[c]) + fabs(surface->specularColor[c]));
+      if (p > peak) peak = p;
+    }
+    if (atten * peak < scene->lightCutoff) {
+      state->stats.lightsCulled++;
+      return 0;
+    }
+  }
+  if (i >= scene->pointLightCount) {
+    // The same test shadeLight() makes, before the shadow ray is traced.
+    real L[3] = {
+      RdNew[0],
+      RdNew[1],
+      RdNew[2]
+    };
+    normalize(L);
+    real LNeg[3] = {
+      -L[0],
+      -L[1],
+      -L[2]
+    };
+    real dotResult = dot(LNeg, light->direction);
+    if (dotResult < light->cosHalfTheta && dotResult >= -1) {
+      state->stats.lightsSkipped++;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// applyLight adds light i, which reaches the surface unshadowed, to color.
+static inline void applyLight(const Scene* scene, int i, const Surface* surface, const real* RdNew, real* color) {
+  // Point lights come first, so each branch of shadeLight() is
+  // resolved once per light rather than per channel.
+  shadeLight(&scene->preparedLights[i], surface, RdNew, i >= scene->pointLightCount, color);
+}
+
+// lightCell returns the light grid cell holding position, or -1 if the
+// scene has no grid or position is outside it.
+static inline int lightCell(const LightGrid* grid, const real* position) {
+  if (grid->cellFirst == NULL) return -1;
+  int cell[3];
+  for (int k = 0; k < 3; k++) {
+    real f = (position[k] - grid->bounds.min[k]) * grid->inverseCell;
+    if (!(f >= 0 && f < grid->dims[k])) return -1;
+    cell[k] = (int)f;
+  }
+  return (cell[2] * grid->dims[1] + cell[1]) * grid->dims[0] + cell[0];
+}
+
+// traceSample shades the primary ray through image point (sx, sy),
+// measured in pixels, into color and returns the index of the object it
+// hits, or -1. The hit point is stored in position unless it is NULL.
+int traceSample(const Scene* scene, RenderState* state, const View* view, real sx, real sy, real* color, real* position) {
+  real Ro[3] = {0, 0, 0};
+  real Rd[3] = {
+    view->cx - (view->w/2) + view->pixwidth * sx,
+    view->cy - (view->h/2) + view->pixheight * sy,
+    1
+  };
+  normalize(Rd);
+
+  real closestT;
+  state->stats.primaryRays++;
+  int closestIndex = closestHit(scene, Ro, Rd, &closestT, &state->stats);
+
+  color[0] = 0;
+  color[1] = 0;
+  color[2] = 0;
+  if (closestT < INFINITY) {
+    Surface surface;
+    const Object* object = &scene->objects[closestIndex];
+    initSurface(&surface, object, &scene->materials[object->material], closestT, Ro, Rd);
+    if (position != NULL) {
+      memcpy(position, surface.position, sizeof(surface.position));
+    }
+
+    // Merge the global lights with the lights of the hit point's grid
+    // cell, so that lights are still added in order.
+    const LightGrid* grid = &scene->lightGrid;
+    int cell = lightCell(grid, surface.position);
+    const int* near = NULL;
+    int nearCount = 0;
+    if (cell >= 0) {
+      near = grid->cellLights + grid->cellFirst[cell];
+      nearCount = grid->cellFirst[cell + 1] - grid->cellFirst[cell];
+    }
+    for (int g = 0, n = 0; g < grid->globalCount || n < nearCount;) {
+      int i = n == nearCount || (g < grid->globalCount && grid->global[g] < near[n]) ? grid->global[g++] : near[n++];
+      real RdNew[3];
+      lightDirection(&scene->preparedLights[i], &surface, RdNew);
+      if (!lightReaches(scene, state, i, &surface, RdNew)) continue;
+      if (shadowed(scene, state, i, surface.position, RdNew, magnitude(RdNew), closestIndex)) continue;
+      applyLight(scene, i, &surface, RdNew, color);
+    }
+  }
+  return closestIndex;
+}
+
+// storePixel clamps color into out.
+static inline void storePixel(const real* color, Pixel* out) {
+  out->r = (unsigned char)(clamp(color[0], 0, 1) * MAX_COLOR_VALUE);
+  out->g = (unsigned char)(clamp(color[1], 0, 1) * MAX_COLOR_VALUE);
+  out->b = (unsigned char)(clamp(color[2], 0, 1) * MAX_COLOR_VALUE);
+}
+
+// renderPixel traces the ray through the center of pixel (x, y), stores
+// the shaded result in out and returns the index of the object hit. If
+// bounds is not NULL it is grown to hold the hit point.
+int renderPixel(const Scene* scene, RenderState* state, const View* view, int x, int y, Pixel* out, AABB* bounds) {
+  real color[3];
+  real position[3];
+  int hit = traceSample(scene, state, view, x + 0.5, y + 0.5, color, position);
+  storePixel(color, out);
+  if (bounds != NULL && hit >= 0) {
+    aabbGrowPoint(bounds, position);
+  }
+  return hit;
+}
+
+// Largest difference in any channel, out of MAX_COLOR_VALUE, between
+// neighbouring samples that is not treated as an edge.
+#define AA_CONTRAST 16
+
+// refinePixel supersamples pixel (x, y) on an n x n grid, starting at
+// 2 x 2 and doubling n while the samples still straddle an edge (they
+// hit different objects or differ by more than AA_CONTRAST), up to
+// maxSamples. The mean of the last grid is stored in out.
+void refinePixel(const Scene* scene, RenderState* state, const View* view, int x, int y, int maxSamples, Pixel* out) {
+  for (int n = 2; n <= maxSamples; n *= 2) {
+    real sum[3] = {0, 0, 0};
+    real lo[3] = {1, 1, 1};
+    real hi[3] = {0, 0, 0};
+    int firstHit = 0;
+    int uniform = 1;
+    for (int j = 0; j < n; j++) {
+      for (int i = 0; i < n; i++) {
+        real color[3];
+        int hit = traceSample(scene, state, view, x + (i + 0.5) / n, y + (j + 0.5) / n, color, NULL);
+        if (i == 0 && j == 0) {
+          firstHit = hit;
+        } else if (hit != firstHit) {
+          uniform = 0;
+        }
+        for (int c = 0; c < 3; c++) {
+          real v = clamp(color[c], 0, 1);
+          sum[c] += v;
+          lo[c] = v < lo[c] ? v : lo[c];
+          hi[c] = v > hi[c] ? v : hi[c];
+        }
+      }
+    }
+    out->r = (unsigned char)(sum[0] / (n * n) * MAX_COLOR_VALUE);
+    out->g = (unsigned char)(sum[1] / (n * n) * MAX_COLOR_VALUE);
+    out->b = (unsigned char)(sum[2] / (n * n) * MAX_COLOR_VALUE);
+    for (int c = 0; c < 3; c++) {
+      if ((hi[c] - lo[c]) * MAX_COLOR_VALUE > AA_CONTRAST) {
+        uniform = 0;
+      }
+    }
+    if (uniform) break;
+  }
+}
+
+// monotonicSeconds returns a timestamp for measuring elapsed time.
+double monotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Each worker owns a queue of tile indices. The owner takes tiles from
+// the head and idle workers steal half of the remaining range from the
+// tail, so a worker stuck on an expensive region gives its backlog away.
+typedef struct {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+} TileQueue;
+
+// A RenderJob renders columns [xStart, xEnd) of image rows
+// [yStart, yEnd) into pixmap, which holds output rows starting at
+// firstRow, stride pixels apart, each starting at column xStart. Output
+// rows run top-down, so image row y is output row M - 1 - y.
+//
+// Only pixels whose coordinates are multiples of step are traced, and
+// those that are also multiples of skipStep (when it is not 0) are
+// skipped because an earlier pass traced them. Traced pixels are marked
+// in traced unless it is NULL. Workers stop taking tiles once deadline
+// passes, unless it is 0.
+typedef struct {
+  const Scene* scene;
+  View view;
+  Pixel* pixmap;
+  int firstRow;
+  int yStart;
+  int yEnd;
+  int xStart;
+  int xEnd;
+  int stride;
+  int step;
+  int skipStep;
+  double deadline;
+  unsigned char* traced;
+  int* hits; // if not NULL, receives the object hit at each pixel
+  const unsigned char* edges; // if not NULL, only these pixels are supersampled
+  const TileBins* bins; // if not NULL, candidate lists for each tile
+  const unsigned char* dirty; // if not NULL, only tiles marked here are rendered
+  AABB* hitBounds; // if not NULL, receives the box around each rendered tile's hit points
+  int tilesX;
+  int tilesY;
+  int workerCount;
+  TileQueue* queues;
+  jmp_buf* failure; // where running out of memory jumps to, or NULL to exit
+} RenderJob;
+
+typedef struct {
+  RenderJob* job;
+  int id;
+  pthread_t thread;
+  int started; // the thread was created and has to be joined
+  RenderState state;
+} Worker;
+
+// tileFrustum sets f to bound the primary rays through image pixels
+// [x0, x1) x [y0, y1), widened by PACKET_MARGIN.
+void tileFrustum(const View* view, int x0, int y0, int x1, int y1, Frustum* f) {
+  f->u0 = view->cx - (view->w/2) + view->pixwidth * (real)(x0 + 0.5);
+  f->u1 = view->cx - (view->w/2) + view->pixwidth * (real)(x1 - 0.5);
+  f->v0 = view->cy - (view->h/2) + view->pixheight * (real)(y0 + 0.5);
+  f->v1 = view->cy - (view->h/2) + view->pixheight * (real)(y1 - 0.5);
+  f->u0 -= PACKET_MARGIN * (fabs(f->u0) + 1);
+  f->u1 += PACKET_MARGIN * (fabs(f->u1) + 1);
+  f->v0 -= PACKET_MARGIN * (fabs(f->v0) + 1);
+  f->v1 += PACKET_MARGIN * (fabs(f->v1) + 1);
+}
+
+// sphereTiles finds the tiles of job whose primary rays can hit sphere
+// and returns 0 if there are none. Over the sphere's bounding box, x/z
+// and y/z are extreme at the corners, which gives a conservative range
+// of pixels once widened by a pixel on each side. Spheres reaching
+// behind the camera cover every tile.
+int sphereTiles(const RenderJob* job, const Object* sphere, int* tx0, int* ty0, int* tx1, int* ty1) {
+  const View* view = &job->view;
+  const real* c = sphere->position;
+  real r = sphere->sphere.radius;
+  real near = c[2] - r;
+  real far = c[2] + r;
+  if (far < -PACKET_MARGIN * (fabs(c[2]) + r)) return 0;
+
+  real range[2][2];
+  if (near <= PACKET_MARGIN * (fabs(c[2]) + r + 1)) {
+    range[0][0] = job->xStart;
+    range[0][1] = job->xEnd - 1;
+    range[1][0] = job->yStart;
+    range[1][1] = job->yEnd - 1;
+  } else {
+    real origin[2] = {view->cx - (view->w/2), view->cy - (view->h/2)};
+    real size[2] = {view->pixwidth, view->pixheight};
+    for (int i = 0; i < 2; i++) {
+      real lo = c[i] - r;
+      real hi = c[i] + r;
+      real u0 = lo / (lo < 0 ? near : far);
+      real u1 = hi / (hi < 0 ? far : near);
+      u0 -= PACKET_MARGIN * (fabs(u0) + 1);
+      u1 += PACKET_MARGIN * (fabs(u1) + 1);
+      range[i][0] = floor((u0 - origin[i]) / size[i] - 0.5) - 1;
+      range[i][1] = ceil((u1 - origin[i]) / size[i] - 0.5) + 1;
+    }
+  }
+
+  if (range[0][1] < job->xStart || range[0][0] >= job->xEnd) return 0;
+  if (range[1][1] < job->yStart || range[1][0] >= job->yEnd) return 0;
+  int x0 = range[0][0] < job->xStart ? job->xStart : (int)range[0][0];
+  int x1 = range[0][1] >= job->xEnd ? job->xEnd - 1 : (int)range[0][1];
+  int y0 = range[1][0] < job->yStart ? job->yStart : (int)range[1][0];
+  int y1 = range[1][1] >= job->yEnd ? job->yEnd - 1 : (int)range[1][1];
+  *tx0 = (x0 - job->xStart) / TILE_SIZE;
+  *tx1 = (x1 - job->xStart) / TILE_SIZE;
+  *ty0 = (y0 - job->yStart) / TILE_SIZE;
+  *ty1 = (y1 - job->yStart) / TILE_SIZE;
+  return 1;
+}
+
+// planeInTile returns 0 if no primary ray of the tile hits the plane,
+// which is when every ray of the tile's frustum meets it at t < 0.
+int planeInTile(const Object* plane, const Frustum* f) {
+  const real* N = plane->plane.normal;
+  real Vo = dot(plane->position, N);
+  for (int corner = 0; corner < 4; corner++) {
+    real u = corner & 1 ? f->u1 : f->u0;
+    real v = corner & 2 ? f->v1 : f->v0;
+    real Vd = N[0] * u + N[1] * v + N[2];
+    real slack = PACKET_MARGIN * (fabs(N[0] * u) + fabs(N[1] * v) + fabs(N[2]));
+    if (Vo >= 0 ? Vd > -slack : Vd < slack) return 1;
+  }
+  return 0;
+}
+
+// buildBins fills bins with the candidate lists for job's tiles. It
+// returns 0 without building anything when the scene has so many
+// spheres for the number of tiles that few tiles could be listed, or
+// when there is not enough memory for the lists.
+int buildBins(TileBins* bins, const RenderJob* job) {
+  const Scene* scene = job->scene;
+  int tileCount = job->tilesX * job->tilesY;
+  if (scene->sphereCount > (long)tileCount * BIN_MAX_SPHERES) return 0;
+
+  arenaInit(&bins->arena);
+  Arena* arena = &bins->arena;
+  jmp_buf failure;
+  if (setjmp(failure) != 0) {
+    arenaFree(arena);
+    return 0;
+  }
+  arena->failure = &failure;
+  bins->sphereFirst = arenaAlloc(arena, sizeof(int) * tileCount);
+  bins->sphereCount = arenaAlloc(arena, sizeof(int) * tileCount);
+  bins->planeFirst = arenaAlloc(arena, sizeof(int) * tileCount);
+  bins->planeCount = arenaAlloc(arena, sizeof(int) * tileCount);
+  memset(bins->sphereCount, 0, sizeof(int) * tileCount);
+
+  // Count each tile's spheres, then give the tiles under the limit a run
+  // of the candidate arrays and fill them in a second pass.
+  for (int j = 0; j < scene->sphereCount; j++) {
+    int tx0, ty0, tx1, ty1;
+    if (!sphereTiles(job, &scene->objects[scene->spheres[j]], &tx0, &ty0, &tx1, &ty1)) continue;
+    for (int ty = ty0; ty <= ty1; ty++) {
+      for (int tx = tx0; tx <= tx1; tx++) {
+        bins->sphereCount[ty * job->tilesX + tx]++;
+      }
+    }
+  }
+  int listed = 0;
+  for (int tile = 0; tile < tileCount; tile++) {
+    if (bins->sphereCount[tile] > BIN_MAX_SPHERES) {
+      bins->sphereFirst[tile] = -1;
+    } else {
+      bins->sphereFirst[tile] = listed;
+      listed += bins->sphereCount[tile];
+    }
+    bins->sphereCount[tile] = 0;
+  }
+  allocSphereSoA(arena, &bins->spheres, listed);
+  bins->sphereIndex = arenaAlloc(arena, sizeof(int) * (listed + 1));
+  for (int j = 0; j < scene->sphereCount; j++) {
+    int tx0, ty0, tx1, ty1;
+    if (!sphereTiles(job, &scene->objects[scene->spheres[j]], &tx0, &ty0, &tx1, &ty1)) continue;
+    for (int ty = ty0; ty <= ty1; ty++) {
+      for (int tx = tx0; tx <= tx1; tx++) {
+        int tile = ty * job->tilesX + tx;
+        if (bins->sphereFirst[tile] < 0) continue;
+        int k = bins->sphereFirst[tile] + bins->sphereCount[tile]++;
+        bins->spheres.x[k] = scene->sphereSoA.x[j];
+        bins->spheres.y[k] = scene->sphereSoA.y[j];
+        bins->spheres.z[k] = scene->sphereSoA.z[j];
+        bins->spheres.r2[k] = scene->sphereSoA.r2[j];
+        bins->sphereIndex[k] = scene->spheres[j];
+      }
+    }
+  }
+
+  allocPlaneSoA(arena, &bins->planes, tileCount * scene->planeCount);
+  bins->planeIndex = arenaAlloc(arena, sizeof(int) * (tileCount * scene->planeCount + 1));
+  int planes = 0;
+  for (int tile = 0; tile < tileCount; tile++) {
+    int x0 = job->xStart + (tile % job->tilesX) * TILE_SIZE;
+    int y0 = job->yStart + (tile / job->tilesX) * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE < job->xEnd ? x0 + TILE_SIZE : job->xEnd;
+    int y1 = y0 + TILE_SIZE < job->yEnd ? y0 + TILE_SIZE : job->yEnd;
+    Frustum frustum;
+    tileFrustum(&job->view, x0, y0, x1, y1, &frustum);
+    bins->planeFirst[tile] = planes;
+    for (int j = 0; j < scene->planeCount; j++) {
+      if (!planeInTile(&scene->objects[scene->planes[j]], &frustum)) continue;
+      bins->planes.px[planes] = scene->planeSoA.px[j];
+      bins->planes.py[planes] = scene->planeSoA.py[j];
+      bins->planes.pz[planes] = scene->planeSoA.pz[j];
+      bins->planes.nx[planes] = scene->planeSoA.nx[j];
+      bins->planes.ny[planes] = scene->planeSoA.ny[j];
+      bins->planes.nz[planes] = scene->planeSoA.nz[j];
+      bins->planeIndex[planes] = scene->planes[j];
+      planes++;
+    }
+    bins->planeCount[tile] = planes - bins->planeFirst[tile];
+  }
+  arena->failure = NULL;
+  return 1;
+}
+
+// renderPacket renders image pixels [x0, x1) x [y0, y1) of tile, at
+// most PACKET_SIZE on a side, with one closestHitPacket() query for the
+// primary rays, or the tile's candidate lists if it has them, and one
+// shadowPacket() query per light that reaches any of the hits. Each
+// pixel gets exactly the color renderPixel() would give it.
+void renderPacket(RenderJob* job, RenderState* state, int tile, int x0, int y0, int x1, int y1) {
+  const Scene* scene = job->scene;
+  const View* view = &job->view;
+  real Rd[PACKET_RAYS][3];
+  int count = 0;
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      real sx = x + 0.5;
+      real sy = y + 0.5;
+      Rd[count][0] = view->cx - (view->w/2) + view->pixwidth * sx;
+      Rd[count][1] = view->cy - (view->h/2) + view->pixheight * sy;
+      Rd[count][2] = 1;
+      normalize(Rd[count]);
+      count++;
+    }
+  }
+
+  real closestT[PACKET_RAYS];
+  int closest[PACKET_RAYS];
+  state->stats.primaryRays += count;
+  if (job->bins != NULL && job->bins->sphereFirst[tile] >= 0) {
+    closestHitBinned(scene, job->bins, tile, count, Rd, closestT, closest, &state->stats);
+  } else {
+    // The packet's corner rays before normalization bound the rest.
+    Frustum frustum;
+    tileFrustum(view, x0, y0, x1, y1, &frustum);
+    closestHitPacket(scene, &frustum, count, Rd, closestT, closest, &state->stats);
+  }
+
+  // Shading only needs the rays that hit something, packed to the front.
+  const real Ro[3] = {0, 0, 0};
+  Surface surfaces[PACKET_RAYS];
+  real position[PACKET_RAYS][3];
+  int ray[PACKET_RAYS];
+  int ignore[PACKET_RAYS];
+  real color[PACKET_RAYS][3];
+  int hitCount = 0;
+  for (int r = 0; r < count; r++) {
+    color[r][0] = 0;
+    color[r][1] = 0;
+    color[r][2] = 0;
+    if (closestT[r] < INFINITY) {
+      const Object* object = &scene->objects[closest[r]];
+      initSurface(&surfaces[hitCount], object, &scene->materials[object->material], closestT[r], Ro, Rd[r]);
+      memcpy(position[hitCount], surfaces[hitCount].position, sizeof(position[0]));
+      ray[hitCount] = r;
+      ignore[hitCount] = closest[r];
+      if (job->hitBounds != NULL) {
+        aabbGrowPoint(&job->hitBounds[tile], position[hitCount]);
+      }
+      hitCount++;
+    }
+  }
+
+  // Mark the global lights and those of every grid cell a hit falls
+  // in, then visit the marked lights in order.
+  const LightGrid* grid = &scene->lightGrid;
+  uint64_t* bits = state->lightBits;
+  int lightWords = hitCount > 0 ? (scene->pointLightCount + scene->spotLightCount + 63) / 64 : 0;
+  for (int g = 0; g < grid->globalCount && hitCount > 0; g++) {
+    bits[grid->global[g] / 64] |= (uint64_t)1 << (grid->global[g] % 64);
+  }
+  int lastCell = -1;
+  for (int k = 0; k < hitCount; k++) {
+    int cell = lightCell(grid, position[k]);
+    if (cell < 0 || cell == lastCell) continue;
+    lastCell = cell;
+    for (int e = grid->cellFirst[cell]; e < grid->cellFirst[cell + 1]; e++) {
+      bits[grid->cellLights[e] / 64] |= (uint64_t)1 << (grid->cellLights[e] % 64);
+    }
+  }
+
+  for (int w = 0; w < lightWords; w++) {
+    for (uint64_t m = bits[w]; m != 0; m &= m - 1) {
+      int i = w * 64 + __builtin_ctzll(m);
+      real RdNew[PACKET_RAYS][3];
+      real from[PACKET_RAYS][3];
+      real maxT[PACKET_RAYS];
+      int skip[PACKET_RAYS];
+      int hit[PACKET_RAYS];
+      unsigned char blocked[PACKET_RAYS];
+      int lit = 0;
+      for (int k = 0; k < hitCount; k++) {
+        lightDirection(&scene->preparedLights[i], &surfaces[k], RdNew[lit]);
+        if (!lightReaches(scene, state, i, &surfaces[k], RdNew[lit])) continue;
+        memcpy(from[lit], position[k], sizeof(from[0]));
+        maxT[lit] = magnitude(RdNew[lit]);
+        skip[lit] = ignore[k];
+        hit[lit] = k;
+        lit++;
+      }
+      if (lit == 0) continue;
+      shadowPacket(scene, state, i, lit, from, RdNew, maxT, skip, blocked);
+      for (int l = 0; l < lit; l++) {
+        if (!blocked[l]) {
+          applyLight(scene, i, &surfaces[hit[l]], RdNew[l], color[ray[hit[l]]]);
+        }
+      }
+    }
+    bits[w] = 0;
+  }
+
+  int N = view->N;
+  int r = 0;
+  for (int y = y0; y < y1; y++) {
+    Pixel* row = job->pixmap + (long)(view->M - 1 - y - job->firstRow) * job->stride;
+    for (int x = x0; x < x1; x++, r++) {
+      storePixel(color[r], &row[x - job->xStart]);
+      if (job->hits != NULL) {
+        job->hits[(long)y * N + x] = closest[r];
+      }
+    }
+  }
+}
+
+void renderTile(RenderJob* job, RenderState* state, int tile) {
+  int M = job->view.M;
+  int N = job->view.N;
+  int xs = job->xStart;
+  int x0 = xs + (tile % job->tilesX) * TILE_SIZE;
+  int y0 = job->yStart + (tile / job->tilesX) * TILE_SIZE;
+  int x1 = x0 + TILE_SIZE < job->xEnd ? x0 + TILE_SIZE : job->xEnd;
+  int y1 = y0 + TILE_SIZE < job->yEnd ? y0 + TILE_SIZE : job->yEnd;
+  if (job->dirty != NULL && !job->dirty[tile]) return;
+  AABB* bounds = job->hitBounds != NULL ? &job->hitBounds[tile] : NULL;
+  if (bounds != NULL) {
+    aabbEmpty(bounds);
+  }
+
+  // Occluders are only cached within a tile, so no thread depends on
+  // the order in which tiles were handed out.
+  for (int i = 0; i < job->scene->lightCount; i++) {
+    state->lastOccluder[i] = -1;
+  }
+
+  if (job->edges != NULL) {
+    for (int y = y0; y < y1; y++) {
+      Pixel* row = job->pixmap + (long)(M - 1 - y - job->firstRow) * job->stride;
+      for (int x = x0; x < x1; x++) {
+        if (job->edges[(long)y * N + x]) {
+          refinePixel(job->scene, state, &job->view, x, y, job->scene->maxSamples, &row[x - xs]);
+        }
+      }
+    }
+    return;
+  }
+
+  if (job->step == 1 && job->skipStep == 0 && job->scene->packets) {
+    for (int py = y0; py < y1; py += PACKET_SIZE) {
+      for (int px = x0; px < x1; px += PACKET_SIZE) {
+        int px1 = px + PACKET_SIZE < x1 ? px + PACKET_SIZE : x1;
+        int py1 = py + PACKET_SIZE < y1 ? py + PACKET_SIZE : y1;
+        renderPacket(job, state, tile, px, py, px1, py1);
+      }
+    }
+    return;
+  }
+
+  if (job->step == 1 && job->skipStep == 0) {
+    for (int y = y0; y < y1; y++) {
+      Pixel* row = job->pixmap + (long)(M - 1 - y - job->firstRow) * job->stride;
+      for (int x = x0; x < x1; x++) {
+        int hit = renderPixel(job->scene, state, &job->view, x, y, &row[x - xs], bounds);
+        if (job->hits != NULL) {
+          job->hits[(long)y * N + x] = hit;
+        }
+      }
+    }
+    return;
+  }
+
+  int step = job->step;
+  int skip = job->skipStep;
+  for (int y = y0 + (step - y0 % step) % step; y < y1; y += step) {
+    Pixel* row = job->pixmap + (long)(M - 1 - y - job->firstRow) * job->stride;
+    for (int x = x0; x < x1; x += step) {
+      if (skip != 0 && x % skip == 0 && y % skip == 0) continue;
+      renderPixel(job->scene, state, &job->view, x, y, &row[x - xs], NULL);
+      if (job->traced != NULL) {
+        job->traced[(long)y * N + x] = 1;
+      }
+    }
+  }
+}
+
+// nextTile pops a tile from the worker's own queue. Returns -1 when the
+// queue is empty.
+int nextTile(TileQueue* queue) {
+  int tile = -1;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    tile = queue->head;
+    queue->head++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return tile;
+}
+
+// stealTiles moves the back half of another worker's queue into this
+// worker's (empty) queue. Returns 0 when every queue is empty.
+int stealTiles(RenderJob* job, int id) {
+  for (int i = 1; i < job->workerCount; i++) {
+    TileQueue* victim = &job->queues[(id + i) % job->workerCount];
+    int first = 0;
+    int last = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    int remaining = victim->tail - victim->head;
+    if (remaining > 0) {
+      last = victim->tail;
+      first = victim->tail - (remaining + 1) / 2;
+      victim->tail = first;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (last > first) {
+      TileQueue* own = &job->queues[id];
+      pthread_mutex_lock(&own->lock);
+      own->head = first;
+      own->tail = last;
+      pthread_mutex_unlock(&own->lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void* renderWorker(void* arg) {
+  Worker* worker = arg;
+  RenderJob* job = worker->job;
+
+  while (1) {
+    if (job->deadline > 0 && monotonicSeconds() > job->deadline) break;
+    int tile = nextTile(&job->queues[worker->id]);
+    if (tile < 0) {
+      if (!stealTiles(job, worker->id)) break;
+      continue;
+    }
+    renderTile(job, &worker->state, tile);
+  }
+  return NULL;
+}
+
+// setJobColumns limits job to image columns [xStart, xEnd), which are
+// stored at the start of each pixmap row.
+void setJobColumns(RenderJob* job, int xStart, int xEnd) {
+  job->xStart = xStart;
+  job->xEnd = xEnd;
+  job->stride = xEnd - xStart;
+  job->tilesX = (xEnd - xStart + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+// initJob sets up a job that traces every pixel of image rows
+// [yStart, yEnd) of a width x height image.
+void initJob(RenderJob* job, const Scene* scene, Pixel* pixmap, int firstRow, int width, int height, int yStart, int yEnd) {
+  job->scene = scene;
+  job->pixmap = pixmap;
+  job->firstRow = firstRow;
+  job->yStart = yStart;
+  job->yEnd = yEnd;
+  job->step = 1;
+  job->skipStep = 0;
+  job->deadline = 0;
+  job->traced = NULL;
+  job->hits = NULL;
+  job->edges = NULL;
+  job->bins = NULL;
+  job->dirty = NULL;
+  job->hitBounds = NULL;
+  job->failure = scene->arena.failure;
+  setupView(&job->view, scene, width, height);
+  setJobColumns(job, 0, width);
+  job->tilesY = (yEnd - yStart + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+// runJob renders job on the given number of threads. Counters are added
+// to stats unless it is NULL. Returns 0 if the deadline stopped the job
+// before every tile was rendered.
+int runJob(const RenderJob* setup, int threads, RenderStats* stats) {
+  const Scene* scene = setup->scene;
+  RenderJob job = *setup;
+  job.workerCount = threads;
+
+  TileBins bins;
+  int binned = 0;
+  if (job.step == 1 && job.skipStep == 0 && job.edges == NULL && scene->packets) {
+    binned = buildBins(&bins, &job);
+    if (binned) job.bins = &bins;
+  }
+  job.queues = malloc(sizeof(TileQueue) * threads);
+  Worker* workers = calloc(threads, sizeof(Worker));
+  int allocated = job.queues != NULL && workers != NULL;
+  for (int i = 0; allocated && i < threads; i++) {
+    workers[i].state.lastOccluder = malloc(sizeof(int) * (scene->lightCount + 1));
+    workers[i].state.lightBits = calloc(scene->lightCount / 64 + 1, sizeof(uint64_t));
+    allocated = workers[i].state.lastOccluder != NULL && workers[i].state.lightBits != NULL;
+  }
+  if (!allocated) {
+    for (int i = 0; workers != NULL && i < threads; i++) {
+      free(workers[i].state.lastOccluder);
+      free(workers[i].state.lightBits);
+    }
+    free(workers);
+    free(job.queues);
+    if (binned) arenaFree(&bins.arena);
+    outOfMemory(job.failure);
+  }
+
+  // Hand out contiguous runs of tiles so neighbouring tiles stay on the
+  // same core until stealing kicks in.
+  int tileCount = job.tilesX * job.tilesY;
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_init(&job.queues[i].lock, NULL);
+    job.queues[i].head = (int)((long)tileCount * i / threads);
+    job.queues[i].tail = (int)((long)tileCount * (i + 1) / threads);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].job = &job;
+    workers[i].id = i;
+    memset(&workers[i].state.stats, 0, sizeof(RenderStats));
+  }
+  // A worker whose thread could not be started leaves its tiles in its
+  // queue, where the others steal them.
+  for (int i = 1; i < threads; i++) {
+    workers[i].started = pthread_create(&workers[i].thread, NULL, renderWorker, &workers[i]) == 0;
+  }
+  renderWorker(&workers[0]);
+  for (int i = 1; i < threads; i++) {
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+  }
+
+  int complete = 1;
+  for (int i = 0; i < threads; i++) {
+    if (job.queues[i].head < job.queues[i].tail) {
+      complete = 0;
+    }
+    pthread_mutex_destroy(&job.queues[i].lock);
+    if (stats != NULL) {
+      addStats(stats, &workers[i].state.stats);
+    }
+    free(workers[i].state.lastOccluder);
+    free(workers[i].state.lightBits);
+  }
+  free(workers);
+  free(job.queues);
+  if (binned) arenaFree(&bins.arena);
+  return complete;
+}
+
+// renderRows renders image rows [yStart, yEnd) of a width x height
+// image into pixmap, which holds output rows from firstRow on. Counters
+// are added to stats unless it is NULL.
+void renderRows(const Scene* scene, Pixel* pixmap, int firstRow, int width, int height, int yStart, int yEnd, int threads, RenderStats* stats) {
+  RenderJob job;
+  initJob(&job, scene, pixmap, firstRow, width, height, yStart, yEnd);
+  runJob(&job, threads, stats);
+}
+
+// renderRegion renders output pixels [x0, x1) x [y0, y1), counted from
+// the top left, of a width x height image into pixmap, which is
+// x1 - x0 pixels wide. Rays are the same as in a full render.
+void renderRegion(const Scene* scene, Pixel* pixmap, int width, int height, int x0, int y0, int x1, int y1, int threads, RenderStats* stats) {
+  RenderJob job;
+  initJob(&job, scene, pixmap, y0, width, height, height - y1, height - y0);
+  setJobColumns(&job, x0, x1);
+  runJob(&job, threads, stats);
+}
+
+// findEdges marks the pixels that hit a different object from, or
+// differ by more than AA_CONTRAST from, a horizontal or vertical
+// neighbour.
+void findEdges(const Pixel* pixmap, const int* hits, int width, int height, unsigned char* edges) {
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      long i = (long)y * width + x;
+      const Pixel* p = &pixmap[(long)(height - 1 - y) * width + x];
+      int edge = 0;
+      for (int k = 0; k < 4 && !edge; k++) {
+        int nx = x + (k == 0) - (k == 1);
+        int ny = y + (k == 2) - (k == 3);
+        if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+        const Pixel* q = &pixmap[(long)(height - 1 - ny) * width + nx];
+        edge = hits[(long)ny * width + nx] != hits[i] ||
+          abs(p->r - q->r) > AA_CONTRAST || abs(p->g - q->g) > AA_CONTRAST || abs(p->b - q->b) > AA_CONTRAST;
+      }
+      edges[i] = edge;
+    }
+  }
+}
+
+// createScene renders a width x height image into pixmap. When
+// scene->maxSamples is above 1, pixels on edges found after the first
+// pass are then supersampled by refinePixel().
+void createScene(const Scene* scene, Pixel* pixmap, int width, int height, int threads, RenderStats* stats) {
+  if (scene->maxSamples <= 1) {
+    renderRows(scene, pixmap, 0, width, height, 0, height, threads, stats);
+    return;
+  }
+
+  int* hits = malloc(sizeof(int) * width * height);
+  unsigned char* edges = malloc((size_t)width * height);
+  if (hits == NULL || edges == NULL) {
+    free(hits);
+    free(edges);
+    outOfMemory(scene->arena.failure);
+  }
+
+  // Both passes jump here if they run out of memory, so that the
+  // buffers are freed before the failure is passed on.
+  jmp_buf failure;
+  if (setjmp(failure) != 0) {
+    free(hits);
+    free(edges);
+    outOfMemory(scene->arena.failure);
+  }
+
+  RenderJob job;
+  initJob(&job, scene, pixmap, 0, width, height, 0, height);
+  job.failure = &failure;
+  job.hits = hits;
+  runJob(&job, threads, stats);
+
+  findEdges(pixmap, hits, width, height, edges);
+  job.hits = NULL;
+  job.edges = edges;
+  runJob(&job, threads, stats);
+  free(hits);
+  free(edges);
+}
+
+#define P6_HEADER "P6\n# Converted with Robert Rasmussen's ppmrw\n%d %d\n%d\n"
+
+void writeP6Header(FILE* fh, int width, int height) {
+  fprintf(fh, P6_HEADER, width, height, MAX_COLOR_VALUE);
+}
+
+void writeP6(char* outputPath, const Pixel* pixmap, int width, int height) {
+  FILE* fh = fopen(outputPath, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  writeP6Header(fh, width, height);
+  size_t count = (size_t)width * height;
+  int failed = fwrite(pixmap, sizeof(Pixel), count, fh) != count;
+  if (fclose(fh) != 0 || failed) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+}
+
+// A MappedImage is an output file mapped into memory with its P6 header
+// already written, so render threads store pixels straight into the
+// file and there is no separate write once rendering is done.
+typedef struct {
+  char* data;
+  size_t size;
+  Pixel* pixels;
+} MappedImage;
+
+// mapP6 creates outputPath at its final size and maps it into image.
+// The file's blocks are allocated up front, so a full disk is reported
+// here rather than as a fault while rendering. Returns 0 if the output
+// is not a regular file or cannot be mapped, in which case the caller
+// renders into memory and uses writeP6().
+int mapP6(const char* outputPath, int width, int height, MappedImage* image) {
+  char header[128];
+  int headerSize = snprintf(header, sizeof(header), P6_HEADER, width, height, MAX_COLOR_VALUE);
+  int fd = open(outputPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    return 0;
+  }
+
+  image->size = headerSize + sizeof(Pixel) * (size_t)width * height;
+  int error = posix_fallocate(fd, 0, image->size);
+  if (error != 0 && error != EINVAL && error != EOPNOTSUPP) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  if (error != 0 && ftruncate(fd, image->size) != 0) {
+    close(fd);
+    return 0;
+  }
+  image->data = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image->data == MAP_FAILED) return 0;
+  memcpy(image->data, header, headerSize);
+  image->pixels = (Pixel*)(image->data + headerSize);
+  return 1;
+}
+
+void unmapP6(const char* outputPath, MappedImage* image) {
+  if (munmap(image->data, image->size) != 0) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+}
+
+typedef struct {
+  FILE* fh;
+  const Pixel* pixels;
+  size_t count;
+  int failed;
+} BandWrite;
+
+void* writeBand(void* arg) {
+  BandWrite* band = arg;
+  band->failed = fwrite(band->pixels, sizeof(Pixel), band->count, band->fh) != band->count;
+  return NULL;
+}
+
+// streamP6 renders the image in bands of bandRows output rows and writes
+// each band to the file as soon as it is done. A writer thread writes
+// band k while band k + 1 renders, so only two bands are ever in memory.
+void streamP6(char* outputPath, const Scene* scene, int width, int height, int bandRows, int threads, RenderStats* stats) {
+  FILE* fh = fopen(outputPath, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  writeP6Header(fh, width, height);
+
+  if (bandRows > height) {
+    bandRows = height;
+  }
+  Pixel* bands[2];
+  bands[0] = malloc(sizeof(Pixel) * width * bandRows);
+  bands[1] = malloc(sizeof(Pixel) * width * bandRows);
+  if (bands[0] == NULL || bands[1] == NULL) {
+    fprintf(stderr, "Error: Out of memory.\n");
+    exit(1);
+  }
+
+  BandWrite write;
+  pthread_t writer;
+  int writing = 0;
+  int failed = 0;
+  for (int row = 0, band = 0; row < height; row += bandRows, band++) {
+    int rows = height - row < bandRows ? height - row : bandRows;
+    Pixel* pixels = bands[band % 2];
+
+    // Output row r is image row height - 1 - r, so the band's output
+    // rows [row, row + rows) are image rows [height - row - rows, height - row).
+    renderRows(scene, pixels, row, width, height, height - row - rows, height - row, threads, stats);
+
+    if (writing) {
+      pthread_join(writer, NULL);
+      failed |= write.failed;
+    }
+    write.fh = fh;
+    write.pixels = pixels;
+    write.count = (size_t)width * rows;
+    if (pthread_create(&writer, NULL, writeBand, &write) != 0) {
+      writeBand(&write);
+      failed |= write.failed;
+      writing = 0;
+    } else {
+      writing = 1;
+    }
+  }
+  if (writing) {
+    pthread_join(writer, NULL);
+    failed |= write.failed;
+  }
+
+  free(bands[0]);
+  free(bands[1]);
+  if (fclose(fh) != 0 || failed) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+}
+
+#define QUEUE_CAPACITY 8
+
+// Queue passes work between pipeline stages. Pushing blocks while the
+// queue is full and popping blocks while it is empty; popping from a
+// closed, empty queue returns NULL.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  void* items[QUEUE_CAPACITY];
+  int head;
+  int count;
+  int closed;
+} Queue;
+
+void queueInit(Queue* queue) {
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+  queue->head = 0;
+  queue->count = 0;
+  queue->closed = 0;
+}
+
+void queueDestroy(Queue* queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->changed);
+}
+
+void queuePush(Queue* queue, void* item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == QUEUE_CAPACITY) {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  queue->items[(queue->head + queue->count) % QUEUE_CAPACITY] = item;
+  queue->count++;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void queueClose(Queue* queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void* queuePop(Queue* queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  void* item = NULL;
+  if (queue->count > 0) {
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+#define TARGET_CAMERA 0
+#define TARGET_OBJECT 1
+#define TARGET_LIGHT 2
+
+// A FrameChange sets one property of the camera, an object or a light.
+// Objects and lights are numbered from 0 in scene file order.
+typedef struct {
+  int target;
+  int index;
+  int key;
+  real value[3];
+} FrameChange;
+
+typedef struct {
+  FrameChange* changes;
+  int count;
+  int capacity;
+} Frame;
+
+#define FRAME_GEOMETRY 1
+#define FRAME_LIGHTS 2
+
+// propertyAllowed reports whether key is a property of objectType, using
+// the same rules as parseObject().
+int propertyAllowed(int objectType, int key) {
+  switch (key) {
+    case KEY_WIDTH:
+    case KEY_HEIGHT:
+      return objectType == CAMERA;
+    case KEY_RADIUS:
+      return objectType == SPHERE;
+    case KEY_DIFFUSE_COLOR:
+    case KEY_SPECULAR_COLOR:
+      return objectType == SPHERE || objectType == PLANE;
+    case KEY_POSITION:
+      return objectType == SPHERE || objectType == PLANE || objectType == LIGHT;
+    case KEY_NORMAL:
+      return objectType == PLANE;
+    case KEY_COLOR:
+    case KEY_DIRECTION:
+    case KEY_RADIAL_A2:
+    case KEY_RADIAL_A1:
+    case KEY_RADIAL_A0:
+    case KEY_ANGULAR_A0:
+    case KEY_THETA:
+      return objectType == LIGHT;
+  }
+  return 0;
+}
+
+int isVectorKey(int key) {
+  return key == KEY_COLOR || key == KEY_DIFFUSE_COLOR || key == KEY_SPECULAR_COLOR ||
+    key == KEY_POSITION || key == KEY_NORMAL || key == KEY_DIRECTION;
+}
+
+typedef struct {
+  const char* path;
+  const Scene* scene;
+  Queue* frames;
+} FrameReader;
+
+void frameError(const FrameReader* reader, int line, const char* message) {
+  fprintf(stderr, "Error: %s on line %d of \"%s\".\n", message, line, reader->path);
+  exit(1);
+}
+
+// readFrames parses the frame list and queues one Frame per "frame"
+// line. Each line after "frame" has the form
+//
+//   camera <property> <value>
+//   object <index> <property> <values...>
+//   light <index> <property> <values...>
+//
+// using the property names of the scene file. Changes persist into
+// later frames. Blank lines and lines starting with '#' are ignored.
+void* readFrames(void* arg) {
+  FrameReader* reader = arg;
+  FILE* fh = fopen(reader->path, "r");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", reader->path);
+    exit(1);
+  }
+
+  char text[1024];
+  int line = 0;
+  Frame* frame = NULL;
+  while (fgets(text, sizeof(text), fh) != NULL) {
+    line++;
+    char* save;
+    char* word = strtok_r(text, " \t\r\n", &save);
+    if (word == NULL || word[0] == '#') continue;
+
+    if (strcmp(word, "frame") == 0) {
+      if (frame != NULL) {
+        queuePush(reader->frames, frame);
+      }
+      frame = calloc(1, sizeof(Frame));
+      if (frame == NULL) {
+        frameError(reader, line, "Out of memory");
+      }
+      continue;
+    }
+    if (frame == NULL) {
+      frameError(reader, line, "Expected \"frame\"");
+    }
+
+    FrameChange change;
+    int objectType;
+    if (strcmp(word, "camera") == 0) {
+      change.target = TARGET_CAMERA;
+      change.index = 0;
+      objectType = CAMERA;
+    } else if (strcmp(word, "object") == 0 || strcmp(word, "light") == 0) {
+      change.target = word[0] == 'o' ? TARGET_OBJECT : TARGET_LIGHT;
+      char* index = strtok_r(NULL, " \t\r\n", &save);
+      char* indexEnd;
+      change.index = index == NULL ? -1 : (int)strtol(index, &indexEnd, 10);
+      if (index == NULL || *indexEnd != '\0') {
+        frameError(reader, line, "Expected an index");
+      }
+      if (change.target == TARGET_OBJECT) {
+        if (change.index < 0 || change.index >= reader->scene->objectCount) {
+          frameError(reader, line, "Object index out of range");
+        }
+        objectType = reader->scene->objects[change.index].kind;
+      } else {
+        if (change.index < 0 || change.index >= reader->scene->lightCount) {
+          frameError(reader, line, "Light index out of range");
+        }
+        objectType = LIGHT;
+      }
+    } else {
+      frameError(reader, line, "Expected \"frame\", \"camera\", \"object\" or \"light\"");
+    }
+
+    char* property = strtok_r(NULL, " \t\r\n", &save);
+    if (property == NULL) {
+      frameError(reader, line, "Expected a property");
+    }
+    change.key = lookupKey(property, strlen(property));
+    if (!propertyAllowed(objectType, change.key)) {
+      frameError(reader, line, "Improper object field");
+    }
+    int values = isVectorKey(change.key) ? 3 : 1;
+    for (int i = 0; i < values; i++) {
+      char* number = strtok_r(NULL, " \t\r\n", &save);
+      char* numberEnd;
+      if (number == NULL) {
+        frameError(reader, line, "Expected number");
+      }
+      change.value[i] = strtod(number, &numberEnd);
+      if (*numberEnd != '\0') {
+        frameError(reader, line, "Expected number");
+      }
+    }
+
+    if (frame->count == frame->capacity) {
+      frame->capacity = frame->capacity == 0 ? 16 : frame->capacity * 2;
+      frame->changes = realloc(frame->changes, sizeof(FrameChange) * frame->capacity);
+      if (frame->changes == NULL) {
+        frameError(reader, line, "Out of memory");
+      }
+    }
+    frame->changes[frame->count++] = change;
+  }
+
+  if (frame != NULL) {
+    queuePush(reader->frames, frame);
+  }
+  fclose(fh);
+  queueClose(reader->frames);
+  return NULL;
+}
+
+// applyFrame makes a frame's changes to the scene and returns which
+// derived data (FRAME_GEOMETRY, FRAME_LIGHTS) must be rebuilt.
+int applyFrame(Scene* scene, const Frame* frame) {
+  int changed = 0;
+  for (int i = 0; i < frame->count; i++) {
+    const FrameChange* change = &frame->changes[i];
+    const real* v = change->value;
+    if (change->target == TARGET_CAMERA) {
+      if (v[0] <= 0) {
+        fprintf(stderr, "Camera %s must be greater than 0.\n", change->key == KEY_WIDTH ? "width" : "height");
+        exit(1);
+      }
+      if (change->key == KEY_WIDTH) {
+        scene->camera->width = v[0];
+      } else {
+        scene->camera->height = v[0];
+      }
+    } else if (change->target == TARGET_OBJECT) {
+      Object* object = &scene->objects[change->index];
+      switch (change->key) {
+        case KEY_RADIUS:
+          if (v[0] < 0) {
+            fprintf(stderr, "Error: Radius cannot be less than 0.\n");
+            exit(1);
+          }
+          object->sphere.radius = v[0];
+          changed |= FRAME_GEOMETRY;
+          break;
+        case KEY_DIFFUSE_COLOR:
+        case KEY_SPECULAR_COLOR: {
+          // Other objects may share the material, so the object gets a
+          // new one.
+          Material material = scene->materials[object->material];
+          memcpy(change->key == KEY_DIFFUSE_COLOR ? material.diffuseColor : material.specularColor, v, sizeof(real) * 3);
+          *addMaterial(scene) = material;
+          object->material = scene->materialCount - 1;
+          // How far lights reach depends on the brightest material.
+          changed |= FRAME_LIGHTS;
+          break;
+        }
+        case KEY_POSITION:
+          memcpy(object->position, v, sizeof(real) * 3);
+          changed |= FRAME_GEOMETRY;
+          break;
+        case KEY_NORMAL:
+          memcpy(object->plane.normal, v, sizeof(real) * 3);
+          normalize(object->plane.normal);
+          changed |= FRAME_GEOMETRY;
+          break;
+      }
+    } else {
+      Light* light = &scene->lights[change->index];
+      switch (change->key) {
+        case KEY_COLOR:
+          memcpy(light->color, v, sizeof(real) * 3);
+          break;
+        case KEY_POSITION:
+          memcpy(light->position, v, sizeof(real) * 3);
+          break;
+        case KEY_DIRECTION:
+          memcpy(light->direction, v, sizeof(real) * 3);
+          normalize(light->direction);
+          break;
+        case KEY_RADIAL_A2:
+          light->radialAtten[2] = v[0];
+          break;
+        case KEY_RADIAL_A1:
+          light->radialAtten[1] = v[0];
+          break;
+        case KEY_RADIAL_A0:
+          light->radialAtten[0] = v[0];
+          break;
+        case KEY_ANGULAR_A0:
+          light->angularAtten = v[0];
+          break;
+        case KEY_THETA:
+          light->theta = v[0];
+          break;
+      }
+      fillRadialDefaults(light);
+      changed |= FRAME_LIGHTS;
+    }
+  }
+  return changed;
+}
+
+typedef struct {
+  char path[4096];
+  const Pixel* pixels;
+  int width;
+  int height;
+  int failed;
+} FrameWrite;
+
+void* writeFrame(void* arg) {
+  FrameWrite* write = arg;
+  FILE* fh = fopen(write->path, "wb");
+  write->failed = fh == NULL;
+  if (fh == NULL) return NULL;
+  writeP6Header(fh, write->width, write->height);
+  size_t count = (size_t)write->width * write->height;
+  write->failed = fwrite(write->pixels, sizeof(Pixel), count, fh) != count;
+  write->failed |= fclose(fh) != 0;
+  return NULL;
+}
+
+// validFramePattern checks that pattern contains exactly one integer
+// conversion, such as %d or %04d, and no other conversions.
+int validFramePattern(const char* pattern) {
+  int conversions = 0;
+  for (const char* p = pattern; *p != '\0'; p++) {
+    if (*p != '%') continue;
+    p++;
+    if (*p == '%') continue;
+    while (*p >= '0' && *p <= '9') {
+      p++;
+    }
+    if (*p != 'd') return 0;
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+// renderBatch renders every frame listed in framesPath from one resident
+// scene and returns the number of frames. A reader thread parses frames ahead of the renderer and a writer
+// thread saves frame k while frame k + 1 renders. Acceleration data and
+// prepared lights are only rebuilt when a frame changes them.
+int renderBatch(const char* framesPath, Scene* scene, int width, int height, const char* pattern, int threads, RenderStats* stats) {
+  if (!validFramePattern(pattern)) {
+    fprintf(stderr, "Error: Batch output must be a pattern with one frame number, such as frame%%04d.ppm.\n");
+    exit(1);
+  }
+
+  Queue frames;
+  queueInit(&frames);
+  FrameReader reader;
+  reader.path = framesPath;
+  reader.scene = scene;
+  reader.frames = &frames;
+  pthread_t readerThread;
+  if (pthread_create(&readerThread, NULL, readFrames, &reader) != 0) {
+    fprintf(stderr, "Error: Could not start frame reader thread.\n");
+    exit(1);
+  }
+
+  Pixel* pixmaps[2];
+  pixmaps[0] = malloc(sizeof(Pixel) * width * height);
+  pixmaps[1] = malloc(sizeof(Pixel) * width * height);
+  if (pixmaps[0] == NULL || pixmaps[1] == NULL) {
+    fprintf(stderr, "Error: Out of memory.\n");
+    exit(1);
+  }
+  FrameWrite writes[2];
+  pthread_t writer;
+  int writing = 0;
+
+  Frame* frame;
+  int number = 0;
+  while ((frame = queuePop(&frames)) != NULL) {
+    int changed = applyFrame(scene, frame);
+    if (changed & FRAME_GEOMETRY) {
+      buildBVH(scene);
+    }
+    if (changed & FRAME_LIGHTS) {
+      prepareLights(scene);
+    }
+    free(frame->changes);
+    free(frame);
+
+    FrameWrite* write = &writes[number % 2];
+    createScene(scene, pixmaps[number % 2], width, height, threads, stats);
+
+    if (writing) {
+      pthread_join(writer, NULL);
+      if (writes[(number + 1) % 2].failed) {
+        fprintf(stderr, "Error: Could not write output file \"%s\".\n", writes[(number + 1) % 2].path);
+        exit(1);
+      }
+    }
+    snprintf(write->path, sizeof(write->path), pattern, number);
+    write->pixels = pixmaps[number % 2];
+    write->width = width;
+    write->height = height;
+    if (pthread_create(&writer, NULL, writeFrame, write) != 0) {
+      writeFrame(write);
+      writing = 0;
+      if (write->failed) {
+        fprintf(stderr, "Error: Could not write output file \"%s\".\n", write->path);
+        exit(1);
+      }
+    } else {
+      writing = 1;
+    }
+    number++;
+  }
+
+  if (writing) {
+    pthread_join(writer, NULL);
+    if (writes[(number + 1) % 2].failed) {
+      fprintf(stderr, "Error: Could not write output file \"%s\".\n", writes[(number + 1) % 2].path);
+      exit(1);
+    }
+  }
+  pthread_join(readerThread, NULL);
+  queueDestroy(&frames);
+  free(pixmaps[0]);
+  free(pixmaps[1]);
+  return number;
+}
+
+// Pixel spacing of the first progressive pass. Each later pass halves it
+// until every pixel has been traced. It must divide TILE_SIZE.
+#define PROGRESSIVE_STEP 16
+
+// progressivePasses returns the number of passes createProgressive runs
+// when none is cut short: one per step from PROGRESSIVE_STEP down to 1.
+int progressivePasses(void) {
+  int passes = 0;
+  for (int step = PROGRESSIVE_STEP; step >= 1; step /= 2) passes++;
+  return passes;
+}
+
+// replaceP6 writes the image to a temporary file and renames it over
+// path, so a program reading path never sees a partly written image.
+void replaceP6(const char* path, const Pixel* pixmap, int width, int height) {
+  FrameWrite write;
+  if (snprintf(write.path, sizeof(write.path), "%s.tmp", path) >= (int)sizeof(write.path)) {
+    fprintf(stderr, "Error: Output path \"%s\" is too long.\n", path);
+    exit(1);
+  }
+  write.pixels = pixmap;
+  write.width = width;
+  write.height = height;
+  writeFrame(&write);
+  if (write.failed || rename(write.path, path) != 0) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", path);
+    exit(1);
+  }
+}
+
+// fillUntraced copies into every pixel that has not been traced the
+// color of the nearest traced pixel up and to the left on the finest
+// pass grid that has one, so a partial render reads as a blocky preview.
+void fillUntraced(Pixel* pixmap, const unsigned char* traced, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    Pixel* row = pixmap + (long)(height - 1 - y) * width;
+    for (int x = 0; x < width; x++) {
+      if (traced[(long)y * width + x]) continue;
+      for (int step = 2; step <= PROGRESSIVE_STEP; step *= 2) {
+        int ax = x - x % step;
+        int ay = y - y % step;
+        if (traced[(long)ay * width + ax]) {
+          row[x] = pixmap[(long)(height - 1 - ay) * width + ax];
+          break;
+        }
+      }
+    }
+  }
+}
+
+// createProgressive renders coarse-to-fine: the first pass traces one
+// pixel in every PROGRESSIVE_STEP x PROGRESSIVE_STEP block and each
+// later pass traces the pixels on a grid twice as fine. The first pass
+// always finishes; later passes stop taking tiles once budget seconds
+// have passed, and untraced pixels are filled from their neighbours.
+// If passPattern is not NULL, each pass is written to the file it names
+// (with the pass number), replacing the file atomically. Returns the
+// number of passes that finished; the image is exact when all did.
+int createProgressive(const Scene* scene, Pixel* pixmap, int width, int height, double budget, const char* passPattern, int threads, RenderStats* stats) {
+  double deadline = monotonicSeconds() + budget;
+  unsigned char* traced = calloc((size_t)width * height, 1);
+  if (traced == NULL) {
+    fprintf(stderr, "Error: Out of memory.\n");
+    exit(1);
+  }
+  int finished = 0;
+  int pass = 0;
+
+  for (int step = PROGRESSIVE_STEP; step >= 1; step /= 2) {
+    if (step < PROGRESSIVE_STEP && monotonicSeconds() > deadline) break;
+    RenderJob job;
+    initJob(&job, scene, pixmap, 0, width, height, 0, height);
+    job.step = step;
+    job.skipStep = step == PROGRESSIVE_STEP ? 0 : step * 2;
+    job.deadline = step == PROGRESSIVE_STEP ? 0 : deadline;
+    job.traced = traced;
+    int complete = runJob(&job, threads, stats);
+    if (step > 1 || !complete) {
+      fillUntraced(pixmap, traced, width, height);
+    }
+    if (passPattern != NULL) {
+      char path[4096];
+      snprintf(path, sizeof(path), passPattern, pass);
+      replaceP6(path, pixmap, width, height);
+    }
+    pass++;
+    if (!complete) break;
+    finished++;
+  }
+
+  free(traced);
+  return finished;
+}
+
+// Watch mode polls the scene file every WATCH_INTERVAL_MS. Shadow rays
+// only run for magnitude(RdNew) of a unit direction, so an object can
+// shadow hit points no further than SHADOW_REACH from it.
+#define WATCH_INTERVAL_MS 100
+#define SHADOW_REACH (1 + PACKET_MARGIN)
+
+// objectsEqual compares the fields of object a of scene sa and object b
+// of scene sb that rendering uses.
+int objectsEqual(const Scene* sa, const Object* a, const Scene* sb, const Object* b) {
+  if (a->kind != b->kind) return 0;
+  const Material* ma = &sa->materials[a->material];
+  const Material* mb = &sb->materials[b->material];
+  for (int i = 0; i < 3; i++) {
+    if (a->position[i] != b->position[i] || ma->diffuseColor[i] != mb->diffuseColor[i] ||
+        ma->specularColor[i] != mb->specularColor[i]) return 0;
+  }
+  if (a->kind == SPHERE) return a->sphere.radius == b->sphere.radius;
+  for (int i = 0; i < 3; i++) {
+    if (a->plane.normal[i] != b->plane.normal[i]) return 0;
+  }
+  return 1;
+}
+
+// pointBoxDistance2 returns the squared distance from p to box, or
+// infinity if the box is empty.
+static inline real pointBoxDistance2(const AABB* box, const real* p) {
+  if (box->min[0] > box->max[0]) return INFINITY;
+  real d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    if (p[i] < box->min[i]) {
+      d2 += sqr(box->min[i] - p[i]);
+    } else if (p[i] > box->max[i]) {
+      d2 += sqr(p[i] - box->max[i]);
+    }
+  }
+  return d2;
+}
+
+// markObject marks the tiles of job whose pixels object could change:
+// those whose rays can hit it, and those with a hit point within
+// SHADOW_REACH of it in hitBounds.
+void markObject(const RenderJob* job, const AABB* hitBounds, const Object* object, unsigned char* dirty) {
+  int tileCount = job->tilesX * job->tilesY;
+  if (object->kind == SPHERE) {
+    int tx0, ty0, tx1, ty1;
+    if (sphereTiles(job, object, &tx0, &ty0, &tx1, &ty1)) {
+      for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+          dirty[ty * job->tilesX + tx] = 1;
+        }
+      }
+    }
+    real reach = object->sphere.radius + SHADOW_REACH;
+    for (int tile = 0; tile < tileCount; tile++) {
+      if (pointBoxDistance2(&hitBounds[tile], object->position) <= sqr(reach) * (1 + PACKET_MARGIN)) {
+        dirty[tile] = 1;
+      }
+    }
+    return;
+  }
+
+  const real* N = object->plane.normal;
+  real length = magnitude(N);
+  real offset = dot(N, object->position);
+  for (int tile = 0; tile < tileCount; tile++) {
+    int x0 = job->xStart + (tile % job->tilesX) * TILE_SIZE;
+    int y0 = job->yStart + (tile / job->tilesX) * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE < job->xEnd ? x0 + TILE_SIZE : job->xEnd;
+    int y1 = y0 + TILE_SIZE < job->yEnd ? y0 + TILE_SIZE : job->yEnd;
+    Frustum frustum;
+    tileFrustum(&job->view, x0, y0, x1, y1, &frustum);
+    if (planeInTile(object, &frustum)) {
+      dirty[tile] = 1;
+      continue;
+    }
+
+    // The signed distance to the plane is extreme at the box's corners.
+    const AABB* box = &hitBounds[tile];
+    if (box->min[0] > box->max[0]) continue;
+    real lo = -offset;
+    real hi = -offset;
+    for (int i = 0; i < 3; i++) {
+      real a = N[i] * box->min[i];
+      real b = N[i] * box->max[i];
+      lo += a < b ? a : b;
+      hi += a < b ? b : a;
+    }
+    real reach = SHADOW_REACH * length * (1 + PACKET_MARGIN);
+    if (lo <= reach && hi >= -reach) {
+      dirty[tile] = 1;
+    }
+  }
+}
+
+// diffScenes marks the tiles of job that must be rendered again for
+// scene to replace old, given the hit points of the current image in
+// hitBounds, and returns how many there are. Objects are compared by
+// index, since ties between equally near objects go to the lower index.
+// A change to the camera or any light marks every tile.
+int diffScenes(const Scene* old, const Scene* scene, const RenderJob* job, const AABB* hitBounds, unsigned char* dirty) {
+  int tileCount = job->tilesX * job->tilesY;
+  int global = old->camera->width != scene->camera->width || old->camera->height != scene->camera->height ||
+    old->lightCount != scene->lightCount ||
+    memcmp(old->lights, scene->lights, sizeof(Light) * scene->lightCount) != 0;
+  memset(dirty, global, tileCount);
+
+  int objectCount = old->objectCount > scene->objectCount ? old->objectCount : scene->objectCount;
+  for (int i = 0; i < objectCount && !global; i++) {
+    const Object* before = i < old->objectCount ? &old->objects[i] : NULL;
+    const Object* after = i < scene->objectCount ? &scene->objects[i] : NULL;
+    if (before != NULL && after != NULL && objectsEqual(old, before, scene, after)) continue;
+    if (before != NULL) markObject(job, hitBounds, before, dirty);
+    if (after != NULL) markObject(job, hitBounds, after, dirty);
+  }
+
+  int count = 0;
+  for (int tile = 0; tile < tileCount; tile++) {
+    count += dirty[tile];
+  }
+  return count;
+}
+
+// sameFile reports whether two stat results look like the same version
+// of a file. Editors that save by renaming change the inode.
+int sameFile(const struct stat* a, const struct stat* b) {
+  return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// watchScene renders scene to outputPath, then waits for the file at
+// path to change, loads it again and re-renders only the tiles the
+// changes can affect, writing the image after each update. It never
+// returns.
+void watchScene(char* path, Scene* scene, int width, int height, const char* outputPath, int threads, int verbose) {
+  Pixel* pixmap = malloc(sizeof(Pixel) * width * height);
+  RenderJob job;
+  initJob(&job, scene, pixmap, 0, width, height, 0, height);
+  int tileCount = job.tilesX * job.tilesY;
+  job.hitBounds = malloc(sizeof(AABB) * tileCount);
+  unsigned char* dirty = malloc(tileCount);
+  if (pixmap == NULL || job.hitBounds == NULL || dirty == NULL) {
+    fprintf(stderr, "Error: Out of memory.\n");
+    exit(1);
+  }
+
+  struct stat last;
+  if (stat(path, &last) != 0) {
+    fprintf(stderr, "Error: Could not read file \"%s\".\n", path);
+    exit(1);
+  }
+  double start = monotonicSeconds();
+  runJob(&job, threads, NULL);
+  replaceP6(outputPath, pixmap, width, height);
+  if (verbose) {
+    fprintf(stderr, "Watch: rendered %d tiles in %.3f ms\n", tileCount, (monotonicSeconds() - start) * 1000);
+  }
+
+  struct timespec interval = {0, WATCH_INTERVAL_MS * 1000000L};
+  while (1) {
+    nanosleep(&interval, NULL);
+    struct stat current;
+    if (stat(path, &current) != 0 || sameFile(&current, &last)) continue;
+    last = current;
+
+    // A half-saved or mistyped file is reported and the old scene kept
+    // until the file is fixed.
+    start = monotonicSeconds();
+    Scene next;
+    initScene(&next);
+    next.maxSamples = scene->maxSamples;
+    next.packets = scene->packets;
+    next.lightCutoff = scene->lightCutoff;
+    next.parseThreads = scene->parseThreads;
+    next.kernel = scene->kernel;
+    int cached;
+    SceneError error;
+    if (readScene(path, &next, &cached, &error) != RAYCAST_OK) {
+      fprintf(stderr, "Error: %s\n", error.message);
+      fprintf(stderr, "Watch: waiting for \"%s\" to be fixed\n", path);
+      freeScene(&next);
+      continue;
+    }
+    prepareLights(&next);
+    if (!cached) {
+      buildBVH(&next);
+    }
+
+    int count = diffScenes(scene, &next, &job, job.hitBounds, dirty);
+    freeScene(scene);
+    *scene = next;
+    setupView(&job.view, scene, width, height);
+    if (count > 0) {
+      job.dirty = dirty;
+      runJob(&job, threads, NULL);
+      job.dirty = NULL;
+      replaceP6(outputPath, pixmap, width, height);
+    }
+    if (verbose) {
+      fprintf(stderr, "Watch: rendered %d of %d tiles in %.3f ms\n", count, tileCount, (monotonicSeconds() - start) * 1000);
+    }
+  }
+}
+
+// Largest image, in pixels along either side, that the server renders.
+#define MAX_REQUEST_SIZE 16384
+#define MAX_REQUEST_LENGTH 1024
+
+// Requests rendered at once by the server. Later requests wait for one
+// to finish, which also bounds the memory held in pixel buffers.
+#define MAX_CONCURRENT_RENDERS 4
+
+// A PixelBuffer is an image buffer kept by the server between requests.
+typedef struct PixelBuffer {
+  struct PixelBuffer* next;
+  size_t capacity; // in pixels
+  Pixel* pixels;
+} PixelBuffer;
+
+// Server holds the scenes a render server loaded at startup. Scenes are
+// only read while serving, so any number of requests can share them.
+typedef struct {
+  Scene* scenes;
+  char** names;
+  int sceneCount;
+  int threads;
+  pthread_mutex_t poolLock;
+  PixelBuffer* pool;
+  sem_t renders; // free render slots
+} Server;
+
+typedef struct {
+  Server* server;
+  int fd;
+} Connection;
+
+// A RenderRequest asks for the crop rectangle (in output pixels, from the
+// top left) of a width x height render of one scene, optionally with the
+// camera's width or height replaced.
+typedef struct {
+  int scene;
+  int width;
+  int height;
+  int cropX;
+  int cropY;
+  int cropWidth;
+  int cropHeight;
+  double cameraWidth;  // 0 keeps the scene's value
+  double cameraHeight;
+} RenderRequest;
+
+void returnBuffer(Server* server, PixelBuffer* buffer) {
+  pthread_mutex_lock(&server->poolLock);
+  buffer->next = server->pool;
+  server->pool = buffer;
+  pthread_mutex_unlock(&server->poolLock);
+}
+
+// takeBuffer returns a pooled buffer that holds at least count pixels,
+// or NULL if there is not enough memory for one.
+PixelBuffer* takeBuffer(Server* server, size_t count) {
+  pthread_mutex_lock(&server->poolLock);
+  PixelBuffer* buffer = server->pool;
+  if (buffer != NULL) {
+    server->pool = buffer->next;
+  }
+  pthread_mutex_unlock(&server->poolLock);
+
+  if (buffer == NULL) {
+    buffer = calloc(1, sizeof(PixelBuffer));
+    if (buffer == NULL) return NULL;
+  }
+  if (buffer->capacity < count) {
+    free(buffer->pixels);
+    buffer->pixels = malloc(sizeof(Pixel) * count);
+    buffer->capacity = buffer->pixels == NULL ? 0 : count;
+    if (buffer->pixels == NULL) {
+      returnBuffer(server, buffer);
+      return NULL;
+    }
+  }
+  return buffer;
+}
+
+int requestInt(char** save, int* value) {
+  char* word = strtok_r(NULL, " \t\r\n", save);
+  if (word == NULL) return 0;
+  char* end;
+  long v = strtol(word, &end, 10);
+  if (*end != '\0' || v < 0 || v > INT_MAX) return 0;
+  *value = (int)v;
+  return 1;
+}
+
+int requestDouble(char** save, double* value) {
+  char* word = strtok_r(NULL, " \t\r\n", save);
+  if (word == NULL) return 0;
+  char* end;
+  *value = strtod(word, &end);
+  return *end == '\0' && *value > 0;
+}
+
+// parseRequest reads a request line of the form
+//
+//   <scene> <width> <height> [crop <x> <y> <w> <h>]
+//     [camera-width <w>] [camera-height <h>]
+//
+// where scene is the scene's index or the path it was loaded from.
+// Returns NULL on success and an error message otherwise.
+const char* parseRequest(const Server* server, char* line, RenderRequest* request) {
+  char* save;
+  char* scene = strtok_r(line, " \t\r\n", &save);
+  if (scene == NULL) return "Expected a scene";
+  request->scene = -1;
+  for (int i = 0; i < server->sceneCount; i++) {
+    char number[16];
+    snprintf(number, sizeof(number), "%d", i);
+    if (strcmp(scene, number) == 0 || strcmp(scene, server->names[i]) == 0) {
+      request->scene = i;
+      break;
+    }
+  }
+  if (request->scene < 0) return "Unknown scene";
+
+  if (!requestInt(&save, &request->width) || !requestInt(&save, &request->height) ||
+      request->width <= 0 || request->height <= 0 ||
+      request->width > MAX_REQUEST_SIZE || request->height > MAX_REQUEST_SIZE) {
+    return "Expected a width and height from 1 to 16384";
+  }
+  request->cropX = 0;
+  request->cropY = 0;
+  request->cropWidth = request->width;
+  request->cropHeight = request->height;
+  request->cameraWidth = 0;
+  request->cameraHeight = 0;
+
+  char* word;
+  while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+    if (strcmp(word, "crop") == 0) {
+      if (!requestInt(&save, &request->cropX) || !requestInt(&save, &request->cropY) ||
+          !requestInt(&save, &request->cropWidth) || !requestInt(&save, &request->cropHeight) ||
+          request->cropWidth == 0 || request->cropHeight == 0 ||
+          request->cropWidth > request->width - request->cropX ||
+          request->cropHeight > request->height - request->cropY) {
+        return "Crop must be a non-empty rectangle inside the image";
+      }
+    } else if (strcmp(word, "camera-width") == 0) {
+      if (!requestDouble(&save, &request->cameraWidth)) return "Camera width must be greater than 0";
+    } else if (strcmp(word, "camera-height") == 0) {
+      if (!requestDouble(&save, &request->cameraHeight)) return "Camera height must be greater than 0";
+    } else {
+      return "Unknown request option";
+    }
+  }
+  return NULL;
+}
+
+// serveConnection answers one request. The reply is a PPM image of the
+// crop rectangle, or a line starting with "ERROR".
+void* serveConnection(void* arg) {
+  Connection* connection = arg;
+  Server* server = connection->server;
+  int fd = connection->fd;
+  free(connection);
+
+  char line[MAX_REQUEST_LENGTH];
+  size_t length = 0;
+  while (length < sizeof(line) - 1) {
+    ssize_t n = read(fd, line + length, sizeof(line) - 1 - length);
+    if (n <= 0) break;
+    length += n;
+    if (memchr(line, '\n', length) != NULL) break;
+  }
+  line[length] = '\0';
+
+  FILE* fh = fdopen(fd, "w");
+  if (fh == NULL) {
+    close(fd);
+    return NULL;
+  }
+  RenderRequest request;
+  const char* error = parseRequest(server, line, &request);
+  if (error != NULL) {
+    fprintf(fh, "ERROR %s\n", error);
+    fclose(fh);
+    return NULL;
+  }
+
+  // Camera overrides go into a private copy of the scene header; the
+  // geometry it points to is shared.
+  Scene scene = server->scenes[request.scene];
+  Camera camera = *scene.camera;
+  if (request.cameraWidth > 0) {
+    camera.width = request.cameraWidth;
+  }
+  if (request.cameraHeight > 0) {
+    camera.height = request.cameraHeight;
+  }
+  scene.camera = &camera;
+
+  while (sem_wait(&server->renders) != 0) {
+    // Interrupted by a signal; keep waiting for a slot.
+  }
+  PixelBuffer* buffer = takeBuffer(server, (size_t)request.cropWidth * request.cropHeight);
+  if (buffer == NULL) {
+    sem_post(&server->renders);
+    fprintf(fh, "ERROR Out of memory\n");
+    fclose(fh);
+    return NULL;
+  }
 
-  double t1 = (-B + det) / (2 * A);
-  if (t1 > 0) return t1;
+  // Running out of memory while rendering fails this request rather
+  // than the server.
+  jmp_buf failure;
+  if (setjmp(failure) != 0) {
+    returnBuffer(server, buffer);
+    sem_post(&server->renders);
+    fprintf(fh, "ERROR Out of memory\n");
+    fclose(fh);
+    return NULL;
+  }
+  scene.arena.failure = &failure;
+  renderRegion(&scene, buffer->pixels, request.width, request.height, request.cropX, request.cropY,
+    request.cropX + request.cropWidth, request.cropY + request.cropHeight, server->threads, NULL);
 
-  return -1;
+  writeP6Header(fh, request.cropWidth, request.cropHeight);
+  fwrite(buffer->pixels, sizeof(Pixel), (size_t)request.cropWidth * request.cropHeight, fh);
+  fclose(fh);
+  returnBuffer(server, buffer);
+  sem_post(&server->renders);
+  return NULL;
 }
 
-double angularAttenuation(const double* Vo, const double* Vl, double a1, double angle) {
-  double dotResult = dot(Vo, Vl);
-  if (acos(dotResult) > angle / 2) {
-    return 0;
-  } else {
-    return pow(dotResult, a1);
+int unixSocket(const char* path, struct sockaddr_un* address) {
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "Error: Socket path \"%s\" is too long.\n", path);
+    exit(1);
   }
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  strcpy(address->sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not create socket.\n");
+    exit(1);
+  }
+  return fd;
 }
 
-double radialAttenuation(double a2, double a1, double a0, double d) {
-  double quotient = a2 * sqr(d) + a1 * d + a0;
-  if (quotient == 0) {
-    return 0;
+// serve loads every scene in paths once and answers render requests on
+// the Unix socket at socketPath until killed, each on its own thread.
+// Every scene is rendered with kernel, packets and lightCutoff.
+void serve(const char* socketPath, char** paths, int sceneCount, const IntersectKernel* kernel, int packets, real lightCutoff, int threads, int verbose) {
+  Server server;
+  server.scenes = malloc(sizeof(Scene) * sceneCount);
+  server.names = paths;
+  server.sceneCount = sceneCount;
+  server.threads = threads;
+  server.pool = NULL;
+  pthread_mutex_init(&server.poolLock, NULL);
+  sem_init(&server.renders, 0, MAX_CONCURRENT_RENDERS);
+  for (int i = 0; i < sceneCount; i++) {
+    initScene(&server.scenes[i]);
+    server.scenes[i].kernel = kernel;
+    server.scenes[i].packets = packets;
+    server.scenes[i].lightCutoff = lightCutoff;
+    server.scenes[i].parseThreads = threads;
+    int cached = loadScene(paths[i], &server.scenes[i]);
+    prepareLights(&server.scenes[i]);
+    if (!cached) {
+      buildBVH(&server.scenes[i]);
+    }
   }
-  if (d == INFINITY) {
-    return 1;
-  } else {
-    return 1.0 / quotient;
+
+  struct sockaddr_un address;
+  int listener = unixSocket(socketPath, &address);
+  struct stat st;
+  if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socketPath);
+  }
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+    fprintf(stderr, "Error: Could not listen on \"%s\".\n", socketPath);
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (verbose) {
+    fprintf(stderr, "Serving %d scenes on %s\n", sceneCount, socketPath);
   }
-}
 
-double diffuseReflection(double Kd, double Il, const double* N, const double* L) {
-  double dotResult = dot(N, L);
-  if (dotResult > 0) {
-    return Kd * Il * dotResult;
-  } else {
-    return 0;
+  while (1) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) continue;
+    Connection* connection = malloc(sizeof(Connection));
+    if (connection == NULL) {
+      close(fd);
+      continue;
+    }
+    connection->server = &server;
+    connection->fd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serveConnection, connection) != 0) {
+      close(fd);
+      free(connection);
+      continue;
+    }
+    pthread_detach(thread);
   }
 }
 
-double specularReflection(double Ks, double Il, const double* V, const double* R, const double* N, const double* L, double ns) {
-  double dotResult = dot(V, R);
-  if (dotResult > 0 && dot(N, L) > 0) {
-    return Ks * Il * pow(dotResult, ns);
-  } else {
-    return 0;
+// requestRender sends one request to the server at socketPath and saves
+// the image it returns at outputPath.
+void requestRender(const char* socketPath, const char* request, const char* outputPath) {
+  struct sockaddr_un address;
+  int fd = unixSocket(socketPath, &address);
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Error: Could not connect to \"%s\".\n", socketPath);
+    exit(1);
+  }
+  FILE* connection = fdopen(fd, "r+");
+  fprintf(connection, "%s\n", request);
+  fflush(connection);
+
+  char reply[MAX_REQUEST_LENGTH];
+  size_t n = fread(reply, 1, 6, connection);
+  if (n == 6 && memcmp(reply, "ERROR ", 6) == 0) {
+    if (fgets(reply, sizeof(reply), connection) == NULL) {
+      reply[0] = '\0';
+    }
+    fprintf(stderr, "Error: %s", reply);
+    exit(1);
+  }
+
+  FILE* fh = fopen(outputPath, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  do {
+    fwrite(reply, 1, n, fh);
+  } while ((n = fread(reply, 1, sizeof(reply), connection)) > 0);
+  fclose(connection);
+  if (fclose(fh) != 0) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", outputPath);
+    exit(1);
   }
 }
 
-void createScene(int width, int height) {
-  double cx = 0;
-  double cy = 0;
-  double h = camera[0]->height;
-  double w = camera[0]->width;
+// writeRegion saves a region rendered by renderRegion() as a PPM whose
+// header records where the region belongs, for example
+// "# region 0 240 640 480 of 640 480". Other programs see an ordinary
+// image of the region.
+void writeRegion(const char* path, const Pixel* pixmap, int width, int height, int x0, int y0, int x1, int y1) {
+  FILE* fh = fopen(path, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", path);
+    exit(1);
+  }
+  fprintf(fh, "P6\n# region %d %d %d %d of %d %d\n%d %d\n%d\n", x0, y0, x1, y1, width, height, x1 - x0, y1 - y0, MAX_COLOR_VALUE);
+  size_t count = (size_t)(x1 - x0) * (y1 - y0);
+  if (fwrite(pixmap, sizeof(Pixel), count, fh) != count || fclose(fh) != 0) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", path);
+    exit(1);
+  }
+}
 
-  int M = height;
-  int N = width;
+// ppmToken reads the next whitespace-separated header field of a PPM,
+// skipping comments. A "# region" comment is stored in region.
+int ppmToken(FILE* fh, char* token, size_t size, int* region, int* hasRegion) {
+  int c = fgetc(fh);
+  while (c != EOF && (isspace(c) || c == '#')) {
+    if (c == '#') {
+      char comment[256];
+      if (fgets(comment, sizeof(comment), fh) == NULL) return 0;
+      if (sscanf(comment, " region %d %d %d %d of %d %d", &region[0], &region[1], &region[2], &region[3], &region[4], &region[5]) == 6) {
+        *hasRegion = 1;
+      }
+    }
+    c = fgetc(fh);
+  }
+  size_t n = 0;
+  while (c != EOF && !isspace(c) && n + 1 < size) {
+    token[n++] = c;
+    c = fgetc(fh);
+  }
+  token[n] = '\0';
+  return n > 0;
+}
 
-  double pixheight = h / M;
-  double pixwidth = w / N;
+// openP6 opens the P6 image at path and reads its header, leaving the
+// file at the first pixel. region receives the placement recorded by
+// writeRegion(), or the whole image if there is none.
+FILE* openP6(const char* path, int* width, int* height, int* region) {
+  FILE* fh = fopen(path, "rb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", path);
+    exit(1);
+  }
+  char token[32];
+  int hasRegion = 0;
+  int w = 0, h = 0, maxValue = 0;
+  if (!ppmToken(fh, token, sizeof(token), region, &hasRegion) || strcmp(token, "P6") != 0 ||
+      !ppmToken(fh, token, sizeof(token), region, &hasRegion) || (w = atoi(token)) <= 0 ||
+      !ppmToken(fh, token, sizeof(token), region, &hasRegion) || (h = atoi(token)) <= 0 ||
+      !ppmToken(fh, token, sizeof(token), region, &hasRegion) || (maxValue = atoi(token)) != MAX_COLOR_VALUE) {
+    fprintf(stderr, "Error: \"%s\" is not a P6 image with 255 levels.\n", path);
+    exit(1);
+  }
+  if (!hasRegion) {
+    region[0] = 0;
+    region[1] = 0;
+    region[2] = w;
+    region[3] = h;
+    region[4] = w;
+    region[5] = h;
+  }
+  *width = w;
+  *height = h;
+  return fh;
+}
 
-  for (int y = 0; y < M; y++) {
-    for (int x = 0; x < N; x++) {
-      double Ro[3] = {0, 0, 0};
-      double Rd[3] = {
-        cx - (w/2) + pixwidth * (x + 0.5),
-        cy - (h/2) + pixheight * (y + 0.5),
-        1
-      };
-      normalize(Rd);
+// diffImages compares two images of the same size and prints the
+// largest difference in any channel, how many pixels differ and the mean
+// absolute error per channel. Returns 1 if the images differ.
+int diffImages(const char* pathA, const char* pathB) {
+  int width[2], height[2];
+  int region[6];
+  const char* paths[2] = {pathA, pathB};
+  Pixel* pixels[2];
+  for (int i = 0; i < 2; i++) {
+    FILE* fh = openP6(paths[i], &width[i], &height[i], region);
+    size_t count = (size_t)width[i] * height[i];
+    pixels[i] = malloc(sizeof(Pixel) * count);
+    if (fread(pixels[i], sizeof(Pixel), count, fh) != count) {
+      fprintf(stderr, "Error: \"%s\" is truncated.\n", paths[i]);
+      exit(1);
+    }
+    fclose(fh);
+  }
+  if (width[0] != width[1] || height[0] != height[1]) {
+    fprintf(stderr, "Error: Images are %d x %d and %d x %d.\n", width[0], height[0], width[1], height[1]);
+    exit(1);
+  }
 
-      double closestT = INFINITY;
-      Object* closestObject = NULL;
-      for (int i = 0; objects[i] != NULL; i++) {
-        double t = 0;
+  size_t count = (size_t)width[0] * height[0];
+  int maxError = 0;
+  long differing = 0;
+  double totalError = 0;
+  for (size_t i = 0; i < count; i++) {
+    int errors[3] = {
+      abs(pixels[0][i].r - pixels[1][i].r),
+      abs(pixels[0][i].g - pixels[1][i].g),
+      abs(pixels[0][i].b - pixels[1][i].b)
+    };
+    int pixelError = 0;
+    for (int c = 0; c < 3; c++) {
+      totalError += errors[c];
+      if (errors[c] > pixelError) pixelError = errors[c];
+    }
+    if (pixelError > 0) differing++;
+    if (pixelError > maxError) maxError = pixelError;
+  }
+  printf("max error %d, %ld of %zu pixels differ (%.3f%%), mean error %.4f\n",
+    maxError, differing, count, 100.0 * differing / count, totalError / (3.0 * count));
+  free(pixels[0]);
+  free(pixels[1]);
+  return differing > 0;
+}
 
-        switch(objects[i]->kind) {
-          case PLANE:
-            t = planeIntersection(Ro, Rd,
-              objects[i]->position,
-              objects[i]->plane.normal);
-            break;
-          case SPHERE:
-            t = sphereIntersection(Ro, Rd,
-              objects[i]->position,
-              objects[i]->sphere.radius);
-            break;
-          default:
-            fprintf(stderr, "Error: Object does not have an appropriate kind.");
-            exit(1);
-        }
+// mergeRegions pastes the region PPMs written by --region into one image
+// and saves it at outputPath. Images without a region comment are
+// treated as covering the whole frame. Every pixel must be covered.
+void mergeRegions(const char* outputPath, char** paths, int count) {
+  Pixel* image = NULL;
+  unsigned char* covered = NULL;
+  int width = 0;
+  int height = 0;
 
-        if (t > 0 && t < closestT) {
-          closestT = t;
-          closestObject = objects[i];
-        }
+  for (int i = 0; i < count; i++) {
+    int w, h;
+    int region[6];
+    FILE* fh = openP6(paths[i], &w, &h, region);
+    if (image == NULL) {
+      width = region[4];
+      height = region[5];
+      if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Error: \"%s\" has an invalid region.\n", paths[i]);
+        exit(1);
+      }
+      image = malloc(sizeof(Pixel) * width * height);
+      covered = calloc((size_t)width * height, 1);
+      if (image == NULL || covered == NULL) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        exit(1);
+      }
+    }
+    if (region[4] != width || region[5] != height || region[0] < 0 || region[1] < 0 ||
+        region[2] > width || region[3] > height || region[2] - region[0] != w || region[3] - region[1] != h) {
+      fprintf(stderr, "Error: Region of \"%s\" does not fit a %d x %d image.\n", paths[i], width, height);
+      exit(1);
+    }
+    for (int y = region[1]; y < region[3]; y++) {
+      if (fread(image + (long)y * width + region[0], sizeof(Pixel), w, fh) != (size_t)w) {
+        fprintf(stderr, "Error: \"%s\" is truncated.\n", paths[i]);
+        exit(1);
       }
+      memset(covered + (long)y * width + region[0], 1, w);
+    }
+    fclose(fh);
+  }
 
-      if (closestT < INFINITY) {
-        double color[3];
-        color[0] = 0;
-        color[1] = 0;
-        color[2] = 0;
-
-        for (int i = 0; lights[i] != NULL; i++) {
-          double RoNew[3] = {
-            closestT * Rd[0] + Ro[0],
-            closestT * Rd[1] + Ro[1],
-            closestT * Rd[2] + Ro[2]
-          };
-          double RdNew[3] = {
-            lights[i]->position[0] - RoNew[0],
-            lights[i]->position[1] - RoNew[1],
-            lights[i]->position[2] - RoNew[2]
-          };
-
-          normalize(RdNew);
-
-          int shadow = 0;
-          for (int j = 0; objects[j] != NULL; j++) {
-            double t = 0;
-            if (objects[j] == closestObject) continue;
-            switch(objects[j]->kind) {
-              case PLANE:
-                t = planeIntersection(RoNew, RdNew,
-                  objects[j]->position,
-                  objects[j]->plane.normal);
-                break;
-              case SPHERE:
-                t = sphereIntersection(RoNew, RdNew,
-                  objects[j]->position,
-                  objects[j]->sphere.radius);
-                break;
-              default:
-                fprintf(stderr, "Error: Object does not have an appropriate kind.");
-                exit(1);
-            }
-            if (t > 0 && t < magnitude(RdNew)) {
-              shadow = 1;
-              break;
-            }
-          }
+  if (memchr(covered, 0, (size_t)width * height) != NULL) {
+    fprintf(stderr, "Error: The regions do not cover the whole %d x %d image.\n", width, height);
+    exit(1);
+  }
+  FILE* fh = fopen(outputPath, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Could not open output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  writeP6Header(fh, width, height);
+  if (fwrite(image, sizeof(Pixel), (size_t)width * height, fh) != (size_t)width * height || fclose(fh) != 0) {
+    fprintf(stderr, "Error: Could not write output file \"%s\".\n", outputPath);
+    exit(1);
+  }
+  free(image);
+  free(covered);
+}
 
-          if (shadow == 0) {
-            double N[3];
-            if (closestObject->kind == PLANE) {
-              N[0] = closestObject->plane.normal[0];
-              N[1] = closestObject->plane.normal[1];
-              N[2] = closestObject->plane.normal[2];
-            } else if (closestObject->kind == SPHERE) {
-              N[0] = RoNew[0] - closestObject->position[0];
-              N[1] = RoNew[1] - closestObject->position[1];
-              N[2] = RoNew[2] - closestObject->position[2];
-            }
+// distributeRender renders a width x height image with processes copies
+// of this program, each rendering a band of rows with --region, then
+// merges the bands into outputPath. workerArgs are passed to every
+// worker ahead of the region arguments.
+void distributeRender(int processes, char** workerArgs, int workerArgCount, int width, int height, char* inputPath, const char* outputPath) {
+  if (processes > height) {
+    processes = height;
+  }
+  char self[4096];
+  ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (length <= 0) {
+    fprintf(stderr, "Error: Could not find the raycast executable.\n");
+    exit(1);
+  }
+  self[length] = '\0';
 
-            normalize(N);
-            double L[3] = {
-              RdNew[0],
-              RdNew[1],
-              RdNew[2]
-            };
-            normalize(L);
-            double LNeg[3] = {
-              -L[0],
-              -L[1],
-              -L[2]
-            };
-            double R[3];
-            reflect(L, N, R);
-            double V[3] = {
-              Rd[0],
-              Rd[1],
-              Rd[2]
-            };
-
-            double pos[3] = {
-              lights[i]->position[0],
-              lights[i]->position[1],
-              lights[i]->position[2]
-            };
-            subtract(pos, RoNew);
-            double d = magnitude(pos);
-
-            double col;
-            for (int c = 0; c < 3; c++) {
-              col = 1;
-              if (lights[i]->angularAtten != INFINITY && lights[i]->theta != 0) {
-                col *= angularAttenuation(LNeg, lights[i]->direction, lights[i]->angularAtten, degreesToRads(lights[i]->theta));
-              }
-              if (lights[i]->radialAtten[0] != INFINITY) {
-                col *= radialAttenuation(lights[i]->radialAtten[2], lights[i]->radialAtten[1], lights[i]->radialAtten[0], d);
-              }
-              col *= (diffuseReflection(closestObject->diffuseColor[c], lights[i]->color[c], N, L) + (specularReflection(closestObject->specularColor[c], lights[i]->color[c], V, R, N, L, 20)));
-              color[c] += col;
-            }
-          }
-        }
-        if (closestObject != NULL) {
-          pixmap[(M - 1) * N - (y * N) + x].r = (unsigned char)(clamp(color[0], 0, 1) * MAX_COLOR_VALUE);
-          pixmap[(M - 1) * N - (y * N) + x].g = (unsigned char)(clamp(color[1], 0, 1) * MAX_COLOR_VALUE);
-          pixmap[(M - 1) * N - (y * N) + x].b = (unsigned char)(clamp(color[2], 0, 1) * MAX_COLOR_VALUE);
-        }  else {
-            pixmap[(M - 1) * N - (y * N) + x].r = 0;
-            pixmap[(M - 1) * N - (y * N) + x].g = 0;
-            pixmap[(M - 1) * N - (y * N) + x].b = 0;
-          }
-    } else {
-        pixmap[(M - 1) * N - (y * N) + x].r = 0;
-        pixmap[(M - 1) * N - (y * N) + x].g = 0;
-        pixmap[(M - 1) * N - (y * N) + x].b = 0;
+  // Everything is allocated before the first worker starts, so running
+  // out of memory never leaves workers behind.
+  char** parts = malloc(sizeof(char*) * processes);
+  pid_t* pids = malloc(sizeof(pid_t) * processes);
+  char** args = malloc(sizeof(char*) * (workerArgCount + 12));
+  if (parts == NULL || pids == NULL || args == NULL) {
+    fprintf(stderr, "Error: Out of memory.\n");
+    exit(1);
+  }
+  for (int i = 0; i < processes; i++) {
+    parts[i] = malloc(strlen(outputPath) + 32);
+    if (parts[i] == NULL) {
+      fprintf(stderr, "Error: Out of memory.\n");
+      exit(1);
+    }
+    sprintf(parts[i], "%s.part%d", outputPath, i);
+  }
+
+  for (int i = 0; i < processes; i++) {
+    int y0 = (int)((long)height * i / processes);
+    int y1 = (int)((long)height * (i + 1) / processes);
+
+    // raycast [workerArgs] --region 0 y0 width y1 width height input part
+    char numbers[6][16];
+    int values[6] = {0, y0, width, y1, width, height};
+    int n = 0;
+    args[n++] = self;
+    for (int j = 0; j < workerArgCount; j++) {
+      args[n++] = workerArgs[j];
+    }
+    args[n++] = "--region";
+    for (int j = 0; j < 6; j++) {
+      snprintf(numbers[j], sizeof(numbers[j]), "%d", values[j]);
+      args[n++] = numbers[j];
+    }
+    args[n++] = inputPath;
+    args[n++] = parts[i];
+    args[n] = NULL;
+
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      fprintf(stderr, "Error: Could not start worker process.\n");
+      exit(1);
+    }
+    if (pids[i] == 0) {
+      execv(self, args);
+      _exit(127);
+    }
+  }
+  free(args);
+
+  int failed = 0;
+  for (int i = 0; i < processes; i++) {
+    int status;
+    if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed = 1;
+    }
+  }
+  if (failed) {
+    for (int i = 0; i < processes; i++) {
+      unlink(parts[i]);
+    }
+    fprintf(stderr, "Error: A worker process failed.\n");
+    exit(1);
+  }
+
+  mergeRegions(outputPath, parts, processes);
+  for (int i = 0; i < processes; i++) {
+    unlink(parts[i]);
+    free(parts[i]);
+  }
+  free(parts);
+  free(pids);
+}
+
+// randomRange returns a deterministic pseudo-random number in [lo, hi).
+double randomRange(unsigned int* seed, double lo, double hi) {
+  *seed = *seed * 1103515245 + 12345;
+  return lo + (hi - lo) * ((*seed >> 8) & 0xffffff) / 16777216.0;
+}
+
+// benchmarkKernels times every supported intersection kernel against a
+// fixed pseudo-random set of spheres, planes and rays and reports
+// intersections per second. Results are compared with the scalar kernel.
+void benchmarkKernels() {
+  const int objectCount = 4096;
+  const int rayCount = 256;
+  const int rounds = 20;
+
+  SphereSoA s;
+  PlaneSoA p;
+  Arena arena;
+  arenaInit(&arena);
+  allocSphereSoA(&arena, &s, objectCount);
+  allocPlaneSoA(&arena, &p, objectCount);
+  unsigned int seed = 12345;
+  for (int i = 0; i < objectCount; i++) {
+    s.x[i] = randomRange(&seed, -10, 10);
+    s.y[i] = randomRange(&seed, -10, 10);
+    s.z[i] = randomRange(&seed, 5, 30);
+    s.r2[i] = sqr(randomRange(&seed, 0.1, 2));
+    real n[3] = {
+      randomRange(&seed, -1, 1),
+      randomRange(&seed, -1, 1),
+      randomRange(&seed, -1, 1)
+    };
+    normalize(n);
+    p.px[i] = randomRange(&seed, -10, 10);
+    p.py[i] = randomRange(&seed, -10, 10);
+    p.pz[i] = randomRange(&seed, 5, 30);
+    p.nx[i] = n[0];
+    p.ny[i] = n[1];
+    p.nz[i] = n[2];
+  }
+  real* rays = malloc(sizeof(real) * 6 * rayCount);
+  for (int i = 0; i < rayCount; i++) {
+    real* ray = rays + 6 * i;
+    ray[0] = randomRange(&seed, -1, 1);
+    ray[1] = randomRange(&seed, -1, 1);
+    ray[2] = randomRange(&seed, -1, 1);
+    ray[3] = randomRange(&seed, -0.5, 0.5);
+    ray[4] = randomRange(&seed, -0.5, 0.5);
+    ray[5] = 1;
+    normalize(ray + 3);
+  }
+
+  real* expected = malloc(sizeof(real) * 2 * objectCount * rayCount);
+  real* actual = malloc(sizeof(real) * 2 * objectCount * rayCount + KERNEL_WIDTH);
+  const IntersectKernel* scalar = selectKernel("scalar");
+  for (int r = 0; r < rayCount; r++) {
+    real* out = expected + 2 * objectCount * r;
+    scalar->spheres(&s, 0, objectCount, rays + 6 * r, rays + 6 * r + 3, out);
+    scalar->planes(&p, 0, objectCount, rays + 6 * r, rays + 6 * r + 3, out + objectCount);
+  }
+
+  printf("kernel   spheres/s      planes/s       matches scalar\n");
+  for (int k = 0; k < KERNEL_COUNT; k++) {
+    const IntersectKernel* kernel = &kernels[k];
+    if (!kernel->supported()) {
+      printf("%-8s (not supported on this CPU)\n", kernel->name);
+      continue;
+    }
+
+    double start = monotonicSeconds();
+    for (int round = 0; round < rounds; round++) {
+      for (int r = 0; r < rayCount; r++) {
+        kernel->spheres(&s, 0, objectCount, rays + 6 * r, rays + 6 * r + 3, actual + 2 * objectCount * r);
+      }
+    }
+    double sphereTime = monotonicSeconds() - start;
+
+    start = monotonicSeconds();
+    for (int round = 0; round < rounds; round++) {
+      for (int r = 0; r < rayCount; r++) {
+        kernel->planes(&p, 0, objectCount, rays + 6 * r, rays + 6 * r + 3, actual + 2 * objectCount * r + objectCount);
       }
     }
+    double planeTime = monotonicSeconds() - start;
+
+    double tests = (double)objectCount * rayCount * rounds;
+    int same = memcmp(expected, actual, sizeof(real) * 2 * objectCount * rayCount) == 0;
+    printf("%-8s %-14.4g %-14.4g %s\n", kernel->name, tests / sphereTime, tests / planeTime, same ? "yes" : "NO");
   }
+
+  free(rays);
+  free(expected);
+  free(actual);
+  arenaFree(&arena);
 }
 
-void writeP6(char* outputPath, int width, int height) {
-  FILE* fh = fopen(outputPath, "wb");
-  if (fh == NULL) {
-    fprintf(stderr, "Error: Output file not found.\n");
+// benchmarkParse parses the file repeatedly for at least a second on
+// up to threads threads and reports the best throughput.
+void benchmarkParse(char* fileName, int threads) {
+  MappedFile file;
+  if (!mapFile(fileName, &file)) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", fileName);
+    exit(1);
   }
-  fprintf(fh, "P6\n# Converted with Robert Rasmussen's ppmrw\n%d %d\n%d\n", width, height, MAX_COLOR_VALUE);
-  fwrite(pixmap, sizeof(Pixel), width*height, fh);
-  fclose(fh);
+
+  double best = INFINITY;
+  double total = 0;
+  int runs = 0;
+  int objectCount = 0;
+  int lightCount = 0;
+  while (runs < 3 || total < 1) {
+    Scene scene;
+    initScene(&scene);
+    scene.parseThreads = threads;
+
+    double start = monotonicSeconds();
+    parseFile(file.data, file.size, &scene);
+    double elapsed = monotonicSeconds() - start;
+
+    objectCount = scene.objectCount;
+    lightCount = scene.lightCount;
+    freeScene(&scene);
+    if (elapsed < best) best = elapsed;
+    total += elapsed;
+    runs++;
+  }
+
+  printf("parse: %zu bytes, %d objects, %d lights, %d threads, %d runs, best %.3f ms, %.1f MB/s\n",
+    file.size, objectCount, lightCount, threads, runs, best * 1000, file.size / best / 1e6);
+  unmapFile(&file);
+}
+
+// Library interface declared in raycast.h.
+
+void raycastDefaultOptions(RaycastOptions* options) {
+  options->threads = 1;
+  options->samples = 1;
+  options->packets = 1;
+  options->lightCutoff = 0;
+}
+
+// failWith fills in error, if there is one, and returns its status.
+static RaycastStatus failWith(RaycastError* error, RaycastStatus status, const char* message) {
+  if (error != NULL) {
+    error->status = status;
+    error->line = 0;
+    snprintf(error->message, sizeof(error->message), "%s", message);
+  }
+  return status;
+}
+
+RaycastStatus raycastParseScene(const char* data, size_t size, RaycastScene** result, RaycastError* error) {
+  if (result == NULL) {
+    return failWith(error, RAYCAST_ERROR_ARGUMENT, "No place to store the scene.");
+  }
+  *result = NULL;
+  if (data == NULL) {
+    return failWith(error, RAYCAST_ERROR_ARGUMENT, "No scene data.");
+  }
+  Scene* scene = malloc(sizeof(Scene));
+  if (scene == NULL) {
+    return failWith(error, RAYCAST_ERROR_MEMORY, "Out of memory.");
+  }
+  initScene(scene);
+  scene->kernel = selectKernel(NULL);
+
+  RaycastError parseFailure;
+  RaycastStatus status = parseScene(data, size, scene, &parseFailure);
+  if (status != RAYCAST_OK) {
+    if (error != NULL) *error = parseFailure;
+    freeScene(scene);
+    free(scene);
+    return status;
+  }
+
+  // Building the scene runs out of memory into here rather than exiting.
+  jmp_buf failure;
+  if (setjmp(failure) != 0) {
+    freeScene(scene);
+    free(scene);
+    return failWith(error, RAYCAST_ERROR_MEMORY, "Out of memory.");
+  }
+  scene->arena.failure = &failure;
+  scene->accelArena.failure = &failure;
+  prepareLights(scene);
+  buildBVH(scene);
+  scene->arena.failure = NULL;
+  scene->accelArena.failure = NULL;
+  *result = scene;
+  return failWith(error, RAYCAST_OK, "");
+}
+
+void raycastFreeScene(RaycastScene* scene) {
+  if (scene == NULL) return;
+  freeScene(scene);
+  free(scene);
+}
+
+RaycastStatus raycastRender(RaycastScene* scene, const RaycastOptions* options, int width, int height,
+  unsigned char* pixels, RaycastError* error) {
+  RaycastOptions defaults;
+  raycastDefaultOptions(&defaults);
+  const RaycastOptions* settings = options != NULL ? options : &defaults;
+  if (scene == NULL || pixels == NULL) {
+    return failWith(error, RAYCAST_ERROR_ARGUMENT, "Scene and pixels must not be NULL.");
+  }
+  if (width <= 0 || height <= 0) {
+    return failWith(error, RAYCAST_ERROR_ARGUMENT, "Width and height must be greater than 0.");
+  }
+  int samples = settings->samples;
+  if (samples < 1 || samples > 16 || (samples & (samples - 1)) != 0) {
+    return failWith(error, RAYCAST_ERROR_ARGUMENT, "Antialiasing samples must be 1, 2, 4, 8 or 16.");
+  }
+  if (!(settings->lightCutoff >= 0)) {
+    return failWith(error, RAYCAST_ERROR_ARGUMENT, "Light cutoff must be a number of at least 0.");
+  }
+  int threads = settings->threads;
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads <= 0) {
+    threads = 1;
+  }
+  int packets = settings->packets != 0;
+  real lightCutoff = settings->lightCutoff;
+
+  // Rendering runs out of memory into here rather than exiting. The
+  // lights may have been left half prepared, so a NaN cutoff makes the
+  // next render prepare them again.
+  jmp_buf failure;
+  if (setjmp(failure) != 0) {
+    scene->arena.failure = NULL;
+    scene->lightCutoff = NAN;
+    return failWith(error, RAYCAST_ERROR_MEMORY, "Out of memory.");
+  }
+  scene->arena.failure = &failure;
+  scene->maxSamples = samples;
+  scene->packets = packets;
+  if (scene->lightCutoff != lightCutoff) {
+    scene->lightCutoff = lightCutoff;
+    prepareLights(scene);
+  }
+  createScene(scene, (Pixel*)pixels, width, height, threads, NULL);
+  scene->arena.failure = NULL;
+  return failWith(error, RAYCAST_OK, "");
+}
+
+#ifndef RAYCAST_LIBRARY
+
+void usage() {
+  fprintf(stderr, "Usage: raycast [-j threads] [-v] [--kernel avx2|sse2|scalar] [--no-packets] [--light-cutoff c] [--stream rows] [--stats] width height input.json output.ppm\n"
+    "       raycast [options] --batch frames.txt width height input.json output%%04d.ppm\n"
+    "       raycast [options] --budget-ms ms [--passes pass%%d.ppm] width height input.json output.ppm\n"
+    "       raycast [options] --timings [--repeat n] width height input.json output.ppm\n"
+    "       raycast [options] --watch width height input.json output.ppm\n"
+    "       raycast [options] --region x0 y0 x1 y1 width height input.json part.ppm\n"
+    "       raycast --merge output.ppm part.ppm...\n"
+    "       raycast [options] --distribute processes width height input.json output.ppm\n"
+    "       raycast [-j threads] [-v] [--kernel k] [--no-packets] [--light-cutoff c] --serve socket input.json...\n"
+    "       raycast --client socket \"scene width height [crop x y w h] [camera-width w] [camera-height h]\" output.ppm\n"
+    "       raycast --compile input.json scene.rsc\n"
+    "       raycast --diff a.ppm b.ppm\n"
+    "       raycast --bench-kernels\n"
+    "       raycast [-j threads] --bench-parse input.json\n");
+  exit(1);
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 5) {
-    fprintf(stderr, "Usage: raycast width height input.json output.ppm");
+  int threads = 1;
+  int verbose = 0;
+  const char* kernelName = NULL;
+  int bandRows = 0;
+  const char* statsVariable = getenv("RAYCAST_STATS");
+  int showStats = statsVariable != NULL && statsVariable[0] != '\0' && strcmp(statsVariable, "0") != 0;
+  const char* framesPath = NULL;
+  const char* socketPath = NULL;
+  int region[4] = {0, 0, 0, 0};
+  int hasRegion = 0;
+  int processes = 0;
+  int timings = 0;
+  double budget = 0;
+  int maxSamples = 1;
+  int packets = 1;
+  const char* lightCutoff = NULL;
+  int watch = 0;
+  const char* passPattern = NULL;
+  int repeat = 1;
+
+  int arg = 1;
+  while (arg < argc && argv[arg][0] == '-') {
+    if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+      threads = atoi(argv[arg + 1]);
+      if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      if (threads <= 0) {
+        threads = 1;
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--kernel") == 0 && arg + 1 < argc) {
+      kernelName = argv[arg + 1];
+      arg += 2;
+    } else if (strcmp(argv[arg], "--bench-kernels") == 0) {
+      benchmarkKernels();
+      return 0;
+    } else if (strcmp(argv[arg], "--compile") == 0 && arg + 2 < argc) {
+      compileScene(argv[arg + 1], argv[arg + 2]);
+      return 0;
+    } else if (strcmp(argv[arg], "--region") == 0 && arg + 4 < argc) {
+      for (int i = 0; i < 4; i++) {
+        const char* value = argv[arg + 1 + i];
+        char* end;
+        long coordinate = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || coordinate < 0 || coordinate > INT_MAX) {
+          fprintf(stderr, "Error: Region coordinates must be whole numbers of at least 0.\n");
+          exit(1);
+        }
+        region[i] = (int)coordinate;
+      }
+      hasRegion = 1;
+      arg += 5;
+    } else if (strcmp(argv[arg], "--merge") == 0 && arg + 2 < argc) {
+      mergeRegions(argv[arg + 1], argv + arg + 2, argc - arg - 2);
+      return 0;
+    } else if (strcmp(argv[arg], "--distribute") == 0 && arg + 1 < argc) {
+      processes = atoi(argv[arg + 1]);
+      if (processes <= 0) {
+        fprintf(stderr, "Error: Process count must be at least 1.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--diff") == 0 && arg + 2 < argc) {
+      return diffImages(argv[arg + 1], argv[arg + 2]);
+    } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+      socketPath = argv[arg + 1];
+      arg += 2;
+    } else if (strcmp(argv[arg], "--client") == 0 && arg + 3 < argc) {
+      requestRender(argv[arg + 1], argv[arg + 2], argv[arg + 3]);
+      return 0;
+    } else if (strcmp(argv[arg], "--bench-parse") == 0 && arg + 1 < argc) {
+      benchmarkParse(argv[arg + 1], threads);
+      return 0;
+    } else if (strcmp(argv[arg], "--stream") == 0 && arg + 1 < argc) {
+      bandRows = atoi(argv[arg + 1]);
+      if (bandRows <= 0) {
+        fprintf(stderr, "Error: Stream band must be at least one row.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+      framesPath = argv[arg + 1];
+      arg += 2;
+    } else if (strcmp(argv[arg], "--aa") == 0 && arg + 1 < argc) {
+      maxSamples = atoi(argv[arg + 1]);
+      if (maxSamples < 1 || maxSamples > 16 || (maxSamples & (maxSamples - 1)) != 0) {
+        fprintf(stderr, "Error: Antialiasing samples must be 1, 2, 4, 8 or 16.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--watch") == 0) {
+      watch = 1;
+      arg++;
+    } else if (strcmp(argv[arg], "--no-packets") == 0) {
+      packets = 0;
+      arg++;
+    } else if (strcmp(argv[arg], "--light-cutoff") == 0 && arg + 1 < argc) {
+      lightCutoff = argv[arg + 1];
+      char* end;
+      double cutoff = strtod(lightCutoff, &end);
+      if (*lightCutoff == '\0' || *end != '\0' || !(cutoff >= 0)) {
+        fprintf(stderr, "Error: Light cutoff must be a number no less than 0.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--budget-ms") == 0 && arg + 1 < argc) {
+      budget = atof(argv[arg + 1]) / 1000;
+      if (budget <= 0) {
+        fprintf(stderr, "Error: Time budget must be greater than 0.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--passes") == 0 && arg + 1 < argc) {
+      passPattern = argv[arg + 1];
+      if (!validFramePattern(passPattern)) {
+        fprintf(stderr, "Error: Pass output must be a pattern with one pass number, such as pass%%d.ppm.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--timings") == 0) {
+      timings = 1;
+      arg++;
+    } else if (strcmp(argv[arg], "--repeat") == 0 && arg + 1 < argc) {
+      repeat = atoi(argv[arg + 1]);
+      if (repeat <= 0) {
+        fprintf(stderr, "Error: Repeat count must be at least 1.\n");
+        exit(1);
+      }
+      arg += 2;
+    } else if (strcmp(argv[arg], "--stats") == 0) {
+      showStats = 1;
+      arg++;
+    } else if (strcmp(argv[arg], "-v") == 0) {
+      verbose = 1;
+      arg++;
+    } else {
+      usage();
+    }
+  }
+  const IntersectKernel* kernel = selectKernel(kernelName);
+  if (kernel == NULL) {
+    fprintf(stderr, "Error: Intersection kernel \"%s\" is unknown or not supported on this CPU.\n", kernelName);
+    exit(1);
+  }
+  real cutoff = lightCutoff != NULL ? strtod(lightCutoff, NULL) : 0;
+  if (socketPath != NULL) {
+    if (arg == argc) {
+      usage();
+    }
+    if (maxSamples > 1) {
+      fprintf(stderr, "Error: --aa cannot be combined with --serve.\n");
+      exit(1);
+    }
+    serve(socketPath, argv + arg, argc - arg, kernel, packets, cutoff, threads, verbose);
+    return 0;
+  }
+  if (argc - arg != 4) {
+    usage();
+  }
+  if (passPattern != NULL && budget == 0) {
+    fprintf(stderr, "Error: --passes requires --budget-ms.\n");
+    exit(1);
+  }
+  if (budget > 0 && (framesPath != NULL || bandRows > 0)) {
+    fprintf(stderr, "Error: --budget-ms cannot be combined with --batch or --stream.\n");
+    exit(1);
+  }
+  if (maxSamples > 1 && (budget > 0 || bandRows > 0)) {
+    fprintf(stderr, "Error: --aa cannot be combined with --budget-ms or --stream.\n");
     exit(1);
   }
 
-  int width = atoi(argv[1]);
+  int width = atoi(argv[arg]);
   if (width <= 0) {
     fprintf(stderr, "Error: Width must be greater than 0.");
     exit(1);
   }
-  int height = atoi(argv[2]);
+  int height = atoi(argv[arg + 1]);
   if (height <= 0) {
     fprintf(stderr, "Error: Width must be greater than 0.");
     exit(1);
   }
 
-  pixmap = malloc(sizeof(Pixel) * width * height);
-  camera = malloc(sizeof(Camera));
-  objects = malloc(sizeof(Object*) * 129);
-  lights = malloc(sizeof(Light*) * 129);
+  int partial = hasRegion || processes > 0;
+  if (partial && (framesPath != NULL || bandRows > 0 || budget > 0 || maxSamples > 1)) {
+    fprintf(stderr, "Error: --region and --distribute cannot be combined with --batch, --stream, --budget-ms or --aa.\n");
+    exit(1);
+  }
+  if (watch && (partial || framesPath != NULL || bandRows > 0 || budget > 0 || maxSamples > 1 || repeat > 1)) {
+    fprintf(stderr, "Error: --watch cannot be combined with --region, --distribute, --batch, --stream, --budget-ms, --aa or --repeat.\n");
+    exit(1);
+  }
+  if (hasRegion && (region[0] >= region[2] || region[1] >= region[3] || region[2] > width || region[3] > height)) {
+    fprintf(stderr, "Error: Region must be a non-empty rectangle inside the image.\n");
+    exit(1);
+  }
+  if (processes > 0) {
+    char threadCount[16];
+    snprintf(threadCount, sizeof(threadCount), "%d", threads);
+    char* workerArgs[6] = {"-j", threadCount};
+    int workerArgCount = 2;
+    if (kernelName != NULL) {
+      workerArgs[workerArgCount++] = "--kernel";
+      workerArgs[workerArgCount++] = (char*)kernelName;
+    }
+    if (lightCutoff != NULL) {
+      workerArgs[workerArgCount++] = "--light-cutoff";
+      workerArgs[workerArgCount++] = (char*)lightCutoff;
+    }
+    distributeRender(processes, workerArgs, workerArgCount, width, height, argv[arg + 2], argv[arg + 3]);
+    return 0;
+  }
+
+  Scene scene;
+  initScene(&scene);
+  scene.maxSamples = maxSamples;
+  scene.packets = packets;
+  scene.parseThreads = threads;
+  scene.lightCutoff = cutoff;
+  scene.kernel = kernel;
+  double parseStart = monotonicSeconds();
+  int cached = loadScene(argv[arg + 2], &scene);
+  double parseSeconds = monotonicSeconds() - parseStart;
+
+  double buildStart = monotonicSeconds();
+  prepareLights(&scene);
+  if (!cached) {
+    buildBVH(&scene);
+  }
+  double buildSeconds = monotonicSeconds() - buildStart;
+  if (verbose) {
+    fprintf(stderr, "BVH: %d nodes over %d spheres, %d planes, built in %.3f ms, %s kernel, %s precision\n",
+      scene.nodeCount, scene.sphereCount, scene.planeCount,
+      buildSeconds * 1000, scene.kernel->name, REAL_NAME);
+    fprintf(stderr, "Objects: %d of %zu bytes sharing %d materials of %zu bytes\n",
+      scene.objectCount, sizeof(Object), scene.materialCount, sizeof(Material));
+    const LightGrid* grid = &scene.lightGrid;
+    if (grid->cellFirst != NULL) {
+      fprintf(stderr, "Lights: %d point, %d spot, %d in a %dx%dx%d grid with %d entries, %d global\n",
+        scene.pointLightCount, scene.spotLightCount, scene.lightCount - grid->globalCount,
+        grid->dims[0], grid->dims[1], grid->dims[2],
+        grid->cellFirst[grid->dims[0] * grid->dims[1] * grid->dims[2]], grid->globalCount);
+    } else {
+      fprintf(stderr, "Lights: %d point, %d spot, no grid\n", scene.pointLightCount, scene.spotLightCount);
+    }
+  }
+
+  RenderStats stats;
+  memset(&stats, 0, sizeof(stats));
+  const char* mode = "render";
+  int frames = 1;
+  double renderSeconds = 0;
+  double writeSeconds = 0;
+  double renderStart = monotonicSeconds();
+  if (framesPath != NULL) {
+    mode = "batch";
+    frames = renderBatch(framesPath, &scene, width, height, argv[arg + 3], threads, &stats);
+    renderSeconds = monotonicSeconds() - renderStart;
+    if (verbose) {
+      fprintf(stderr, "Batch: %.3f ms\n", renderSeconds * 1000);
+    }
+  } else if (watch) {
+    watchScene(argv[arg + 2], &scene, width, height, argv[arg + 3], threads, verbose);
+  } else if (bandRows > 0) {
+    mode = "stream";
+    streamP6(argv[arg + 3], &scene, width, height, bandRows, threads, &stats);
+    renderSeconds = monotonicSeconds() - renderStart;
+    if (verbose) {
+      fprintf(stderr, "Render and write: %.3f ms\n", renderSeconds * 1000);
+    }
+  } else if (hasRegion) {
+    mode = "region";
+    Pixel* pixmap = malloc(sizeof(Pixel) * (region[2] - region[0]) * (region[3] - region[1]));
+    if (pixmap == NULL) {
+      fprintf(stderr, "Error: Out of memory.\n");
+      exit(1);
+    }
+    renderRegion(&scene, pixmap, width, height, region[0], region[1], region[2], region[3], threads, &stats);
+    renderSeconds = monotonicSeconds() - renderStart;
+    if (verbose) {
+      fprintf(stderr, "Render: %.3f ms\n", renderSeconds * 1000);
+    }
+
+    double writeStart = monotonicSeconds();
+    writeRegion(argv[arg + 3], pixmap, width, height, region[0], region[1], region[2], region[3]);
+    writeSeconds = monotonicSeconds() - writeStart;
+    free(pixmap);
+  } else if (budget > 0) {
+    mode = "progressive";
+    Pixel* pixmap = malloc(sizeof(Pixel) * width * height);
+    if (pixmap == NULL) {
+      fprintf(stderr, "Error: Out of memory.\n");
+      exit(1);
+    }
+    int passes = createProgressive(&scene, pixmap, width, height, budget, passPattern, threads, &stats);
+    renderSeconds = monotonicSeconds() - renderStart;
+    if (verbose) {
+      fprintf(stderr, "Progressive: %d of %d passes in %.3f ms\n", passes, progressivePasses(), renderSeconds * 1000);
+    }
 
-  parseJSON(argv[3]);
-  createScene(width, height);
+    double writeStart = monotonicSeconds();
+    writeP6(argv[arg + 3], pixmap, width, height);
+    writeSeconds = monotonicSeconds() - writeStart;
+    free(pixmap);
+  } else {
+    // Repeated renders are timed separately and the fastest is kept, which
+    // is less sensitive to other load on the machine than the mean.
+    MappedImage image;
+    int mapped = mapP6(argv[arg + 3], width, height, &image);
+    Pixel* pixmap = mapped ? image.pixels : malloc(sizeof(Pixel) * width * height);
+    for (int i = 0; i < repeat; i++) {
+      RenderStats frameStats;
+      memset(&frameStats, 0, sizeof(frameStats));
+      double frameStart = monotonicSeconds();
+      createScene(&scene, pixmap, width, height, threads, &frameStats);
+      double frameSeconds = monotonicSeconds() - frameStart;
+      if (i == 0 || frameSeconds < renderSeconds) {
+        renderSeconds = frameSeconds;
+      }
+      stats = frameStats;
+    }
+    if (verbose) {
+      fprintf(stderr, "Render: %.3f ms\n", renderSeconds * 1000);
+    }
 
-  writeP6(argv[4], width, height);
+    double writeStart = monotonicSeconds();
+    if (mapped) {
+      unmapP6(argv[arg + 3], &image);
+    } else {
+      writeP6(argv[arg + 3], pixmap, width, height);
+      free(pixmap);
+    }
+    writeSeconds = monotonicSeconds() - writeStart;
+  }
 
-  free(camera[0]);
-  free(camera);
+  // Every primary ray is one sample, so with --aa this is the cost to
+  // compare against uniform supersampling's maxSamples squared.
+  double samplesPerPixel = frames > 0 ? (double)stats.primaryRays / ((double)width * height * frames) : 0;
+  if (verbose && maxSamples > 1) {
+    fprintf(stderr, "Antialiasing: %.3f samples per pixel, up to %d\n", samplesPerPixel, maxSamples * maxSamples);
+  }
 
-  for (int i = 0; objects[i] != NULL; i++) {
-    free(objects[i]);
+  // Timings go to stdout as one JSON object per run so that results from
+  // different builds can be collected and compared by scripts.
+  if (timings) {
+    double rays = (double)stats.primaryRays + stats.shadowRays;
+    printf("{\"scene\": \"%s\", \"mode\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, "
+      "\"threads\": %d, \"kernel\": \"%s\", \"precision\": \"%s\", \"spheres\": %d, \"planes\": %d, \"point_lights\": %d, \"spot_lights\": %d, "
+      "\"parse_ms\": %.3f, \"build_ms\": %.3f, \"render_ms\": %.3f, \"write_ms\": %.3f, \"ms_per_frame\": %.3f, "
+      "\"primary_rays\": %ld, \"samples_per_pixel\": %.3f, \"shadow_rays\": %ld, \"rays_per_sec\": %.0f}\n",
+      argv[arg + 2], mode, width, height, frames,
+      threads, scene.kernel->name, REAL_NAME, scene.sphereCount, scene.planeCount, scene.pointLightCount, scene.spotLightCount,
+      parseSeconds * 1000, buildSeconds * 1000, renderSeconds * 1000, writeSeconds * 1000,
+      frames > 0 ? renderSeconds * 1000 / frames : 0.0,
+      stats.primaryRays, samplesPerPixel, stats.shadowRays, renderSeconds > 0 ? rays / renderSeconds : 0.0);
   }
-  free(objects);
 
-  for (int i = 0; lights[i] != NULL; i++) {
-    free(lights[i]);
+  if (showStats) {
+    fprintf(stderr, "{\"parse_ms\": %.3f, \"build_ms\": %.3f, \"render_ms\": %.3f, \"write_ms\": %.3f, "
+      "\"primary_rays\": %ld, \"samples_per_pixel\": %.3f, \"shadow_rays\": %ld, \"sphere_tests\": %ld, \"plane_tests\": %ld, \"node_visits\": %ld, "
+      "\"shadow_early_outs\": %ld, \"lights_skipped\": %ld, \"lights_culled\": %ld, \"occluder_cache_lookups\": %ld, \"occluder_cache_hits\": %ld, \"packet_culls\": %ld}\n",
+      parseSeconds * 1000, buildSeconds * 1000, renderSeconds * 1000, writeSeconds * 1000,
+      stats.primaryRays, samplesPerPixel, stats.shadowRays, stats.sphereTests, stats.planeTests, stats.nodeVisits,
+      stats.shadowEarlyOuts, stats.lightsSkipped, stats.lightsCulled, stats.occluderCacheLookups, stats.occluderCacheHits, stats.packetCulls);
   }
-  free(lights);
+
+  freeScene(&scene);
 
 #ifdef DEBUG
   displayObjects();
@@ -803,3 +6134,5 @@ int main(int argc, char* argv[]) {
 
   return 0;
 }
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef RAYCAST_H
+#define RAYCAST_H
+
+#include <stddef.h>
+
+// Library interface to the renderer, built as libraycast.a by "make lib".
+// Nothing here touches process-wide state, so different scenes can be
+// parsed and rendered from different threads at the same time. A single
+// scene must only be used by one call at a time.
+
+#define RAYCAST_API __attribute__((visibility("default")))
+
+typedef enum {
+  RAYCAST_OK = 0,
+  RAYCAST_ERROR_ARGUMENT, // an argument is out of range or NULL
+  RAYCAST_ERROR_PARSE,    // the scene is not valid JSON in the expected form
+  RAYCAST_ERROR_MEMORY,   // an allocation failed
+} RaycastStatus;
+
+// RaycastError describes why a call failed. line is the scene line a
+// parse error was found on, or 0. message is one sentence and does not
+// end in a newline.
+typedef struct {
+  RaycastStatus status;
+  int line;
+  char message[256];
+} RaycastError;
+
+typedef struct {
+  int threads;        // render threads; 0 uses every core
+  int samples;        // antialiasing samples per axis at edges: 1 (off), 2, 4, 8 or 16
+  int packets;        // 0 traces rays one at a time; the image is the same
+  double lightCutoff; // skip lights that add less than this to a channel; 0 keeps every light
+} RaycastOptions;
+
+typedef struct RaycastScene RaycastScene;
+
+// raycastDefaultOptions fills options with the settings the command line
+// uses when given no flags.
+RAYCAST_API void raycastDefaultOptions(RaycastOptions* options);
+
+// raycastParseScene parses the JSON scene in data[0, size) and builds it
+// for rendering. On success *scene must later be freed with
+// raycastFreeScene(). On failure *scene is NULL and error, if not NULL,
+// says why.
+RAYCAST_API RaycastStatus raycastParseScene(const char* data, size_t size, RaycastScene** scene, RaycastError* error);
+
+RAYCAST_API void raycastFreeScene(RaycastScene* scene);
+
+// raycastRender renders scene into pixels, which holds width * height
+// RGB triples, one byte per channel, starting at the top left corner and
+// going across each row. The result is the same as the command line's.
+RAYCAST_API RaycastStatus raycastRender(RaycastScene* scene, const RaycastOptions* options, int width, int height,
+  unsigned char* pixels, RaycastError* error);
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// scenegen writes a pseudo-random scene in the JSON format read by
+// raycast. The same arguments always produce the same file, so generated
+// scenes can be used to compare performance between builds.
+
+// randomRange returns a deterministic pseudo-random number in [lo, hi).
+double randomRange(unsigned int* seed, double lo, double hi) {
+  *seed = *seed * 1103515245 + 12345;
+  return lo + (hi - lo) * ((*seed >> 8) & 0xffffff) / 16777216.0;
+}
+
+void usage() {
+  fprintf(stderr, "Usage: scenegen [--spheres n] [--planes n] [--point-lights n] [--spot-lights n] [--materials n] [--light-range r] [--seed n] [output.json]\n");
+  exit(1);
+}
+
+int countArgument(const char* value) {
+  char* end;
+  long count = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || count < 0 || count > 100000000) {
+    fprintf(stderr, "Error: \"%s\" is not a valid count.\n", value);
+    exit(1);
+  }
+  return (int)count;
+}
+
+int main(int argc, char* argv[]) {
+  int spheres = 1000;
+  int planes = 1;
+  int pointLights = 1;
+  int spotLights = 1;
+  int materials = 0; // 0 gives every sphere its own colors
+  double lightRange = 0; // 0 keeps the default, far-reaching point lights
+  unsigned int seed = 1;
+  const char* path = NULL;
+
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--spheres") == 0 && arg + 1 < argc) {
+      spheres = countArgument(argv[++arg]);
+    } else if (strcmp(argv[arg], "--planes") == 0 && arg + 1 < argc) {
+      planes = countArgument(argv[++arg]);
+    } else if (strcmp(argv[arg], "--point-lights") == 0 && arg + 1 < argc) {
+      pointLights = countArgument(argv[++arg]);
+    } else if (strcmp(argv[arg], "--spot-lights") == 0 && arg + 1 < argc) {
+      spotLights = countArgument(argv[++arg]);
+    } else if (strcmp(argv[arg], "--materials") == 0 && arg + 1 < argc) {
+      materials = countArgument(argv[++arg]);
+    } else if (strcmp(argv[arg], "--light-range") == 0 && arg + 1 < argc) {
+      lightRange = countArgument(argv[++arg]);
+    } else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc) {
+      seed = (unsigned int)countArgument(argv[++arg]);
+    } else if (argv[arg][0] != '-' && path == NULL) {
+      path = argv[arg];
+    } else {
+      usage();
+    }
+  }
+
+  FILE* fh = stdout;
+  if (path != NULL) {
+    fh = fopen(path, "w");
+    if (fh == NULL) {
+      fprintf(stderr, "Error: Could not open file \"%s\"\n", path);
+      exit(1);
+    }
+  }
+
+  fprintf(fh, "[\n  { \"type\": \"camera\", \"width\": 1.6, \"height\": 1.2 }");
+
+  // With --materials, spheres take their colors from a palette of that
+  // many entries, every fourth of which is shiny.
+  double* palette = malloc(sizeof(double) * 3 * (materials > 0 ? materials : 1));
+  for (int i = 0; i < materials; i++) {
+    palette[3 * i] = randomRange(&seed, 0, 1);
+    palette[3 * i + 1] = randomRange(&seed, 0, 1);
+    palette[3 * i + 2] = randomRange(&seed, 0, 1);
+  }
+
+  // Spheres fill a box in front of the camera. Radii shrink as the count
+  // grows so that large scenes stay about as crowded as small ones.
+  double scale = 30 / cbrt(spheres > 0 ? spheres : 1);
+  for (int i = 0; i < spheres; i++) {
+    double r, g, b;
+    int shiny = i % 4 == 0;
+    if (materials > 0) {
+      int m = (int)randomRange(&seed, 0, materials);
+      r = palette[3 * m];
+      g = palette[3 * m + 1];
+      b = palette[3 * m + 2];
+      shiny = m % 4 == 0;
+    } else {
+      r = randomRange(&seed, 0, 1);
+      g = randomRange(&seed, 0, 1);
+      b = randomRange(&seed, 0, 1);
+    }
+    fprintf(fh, ",\n  { \"type\": \"sphere\", \"diffuse_color\": [%.3f, %.3f, %.3f]", r, g, b);
+    if (shiny) {
+      fprintf(fh, ", \"specular_color\": [%.3f, %.3f, %.3f]", r, g, b);
+    }
+    double x = randomRange(&seed, -30, 30);
+    double y = randomRange(&seed, -22, 22);
+    double z = randomRange(&seed, 10, 80);
+    double radius = randomRange(&seed, 0.05, 0.5) * scale;
+    fprintf(fh, ", \"position\": [%.3f, %.3f, %.3f], \"radius\": %.4f }", x, y, z, radius);
+  }
+
+  // The first plane is a floor and the rest are walls behind the spheres,
+  // tilted a little so that they do not all face the same way.
+  for (int i = 0; i < planes; i++) {
+    double nx = 0, ny = 1, nz = 0;
+    double px = 0, py = -25, pz = 0;
+    if (i > 0) {
+      nx = randomRange(&seed, -0.3, 0.3);
+      ny = randomRange(&seed, -0.3, 0.3);
+      nz = -1;
+      py = 0;
+      pz = 90 + 10 * i;
+    }
+    double r = randomRange(&seed, 0.2, 0.8);
+    double g = randomRange(&seed, 0.2, 0.8);
+    double b = randomRange(&seed, 0.2, 0.8);
+    fprintf(fh, ",\n  { \"type\": \"plane\", \"diffuse_color\": [%.3f, %.3f, %.3f], \"position\": [%.3f, %.3f, %.3f], \"normal\": [%.3f, %.3f, %.3f] }",
+      r, g, b, px, py, pz, nx, ny, nz);
+  }
+
+  // With --light-range, point lights are scattered among the spheres
+  // and fade to about one output color step at that distance.
+  for (int i = 0; i < pointLights; i++) {
+    double x, y, z;
+    if (lightRange > 0) {
+      x = randomRange(&seed, -30, 30);
+      y = randomRange(&seed, -22, 22);
+      z = randomRange(&seed, 10, 80);
+    } else {
+      x = randomRange(&seed, -20, 20);
+      y = randomRange(&seed, 5, 20);
+      z = randomRange(&seed, 0, 40);
+    }
+    double r = randomRange(&seed, 0.3, 1);
+    double g = randomRange(&seed, 0.3, 1);
+    double b = randomRange(&seed, 0.3, 1);
+    if (lightRange > 0) {
+      fprintf(fh, ",\n  { \"type\": \"light\", \"color\": [%.3f, %.3f, %.3f], \"radial-a2\": %.6f, \"radial-a1\": 0, \"radial-a0\": 1, \"position\": [%.3f, %.3f, %.3f] }",
+        r, g, b, 255 / (lightRange * lightRange), x, y, z);
+    } else {
+      fprintf(fh, ",\n  { \"type\": \"light\", \"color\": [%.3f, %.3f, %.3f], \"radial-a2\": 0.0005, \"radial-a1\": 0.001, \"radial-a0\": 0.1, \"position\": [%.3f, %.3f, %.3f] }",
+        r, g, b, x, y, z);
+    }
+  }
+
+  // Spot lights hang above the scene and point down into it.
+  for (int i = 0; i < spotLights; i++) {
+    double x = randomRange(&seed, -20, 20);
+    double z = randomRange(&seed, 20, 60);
+    double r = randomRange(&seed, 0.5, 1.5);
+    double g = randomRange(&seed, 0.5, 1.5);
+    double b = randomRange(&seed, 0.5, 1.5);
+    double theta = randomRange(&seed, 20, 45);
+    double dx = randomRange(&seed, -0.3, 0.3);
+    double dz = randomRange(&seed, -0.3, 0.3);
+    fprintf(fh, ",\n  { \"type\": \"light\", \"color\": [%.3f, %.3f, %.3f], \"theta\": %.1f, \"angular-a0\": 2, \"radial-a2\": 0.0002, \"radial-a1\": 0.001, \"radial-a0\": 0.1, \"position\": [%.3f, 20, %.3f], \"direction\": [%.3f, -1, %.3f] }",
+      r, g, b, theta, x, z, dx, dz);
+  }
+
+  free(palette);
+
+  fprintf(fh, "\n]\n");
+  if (fh != stdout && fclose(fh) != 0) {
+    fprintf(stderr, "Error: Could not write file \"%s\"\n", path);
+    exit(1);
+  }
+  return 0;
+}